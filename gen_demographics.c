@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Synthetic demographics generator for benchmarking.
+ *
+ * Writes <rows> records with the header of a template CSV (by default
+ * county_demographics.csv). Each record copies a randomly chosen template
+ * row with every number scaled by up to +/-10% and printed with the same
+ * number of decimals, so column types and value ranges match the real data.
+ * County names get a serial number to keep them distinct.
+ *
+ *   gen_demographics <rows> [template.csv] [seed] > out.csv
+ */
+
+#define MAX_FIELDS 200
+
+/* One template row, split into fields; numbers are parsed once up front */
+typedef struct {
+    char *line;                 // owns the text the fields point into
+    char *fields[MAX_FIELDS];
+    double values[MAX_FIELDS];
+    int decimals[MAX_FIELDS];   // -1 for text fields
+    int count;
+} TemplateRow;
+
+static uint64_t rng_state;
+
+/* xorshift64*: fast, and the same output for the same seed everywhere */
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static double random_unit(void) {
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+/* Split a CSV line in place; quotes around a field are dropped */
+static int split_line(char *line, char **fields) {
+    int count = 0;
+    char *p = line;
+    for (;;) {
+        char *start = p;
+        if (*p == '"') {
+            start = ++p;
+            while (*p && *p != '"') p++;
+            if (*p == '"') *p++ = '\0';
+            while (*p && *p != ',' && *p != '\n' && *p != '\r') p++;
+        } else {
+            while (*p && *p != ',' && *p != '\n' && *p != '\r') p++;
+        }
+        char delim = *p;
+        *p = '\0';
+        if (count < MAX_FIELDS) fields[count++] = start;
+        if (delim != ',') break;
+        p++;
+    }
+    return count;
+}
+
+/* Digits after the decimal point, or -1 when s is not a plain number */
+static int number_decimals(const char *s) {
+    const char *p = s;
+    if (*p == '-') p++;
+    if (*p < '0' || *p > '9') return -1;
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '\0') return 0;
+    if (*p != '.') return -1;
+    const char *frac = ++p;
+    while (*p >= '0' && *p <= '9') p++;
+    return *p == '\0' ? (int)(p - frac) : -1;
+}
+
+/* value rounded to the given decimals; snprintf("%.*f") is most of the run time otherwise */
+static int format_fixed(char *buf, double value, int decimals) {
+    static const double scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    if (decimals > 6) return sprintf(buf, "%.*f", decimals, value);
+    char digits[32];
+    int neg = value < 0.0;
+    unsigned long long n = (unsigned long long)((neg ? -value : value)*scale[decimals] + 0.5);
+    int len = 0;
+    do { digits[len++] = '0' + n%10; n /= 10; } while (n || len <= decimals);
+    int pos = 0;
+    if (neg) buf[pos++] = '-';
+    while (len > 0) {
+        if (len == decimals) buf[pos++] = '.';
+        buf[pos++] = digits[--len];
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+static void write_field(const char *value, FILE *out) {
+    putc_unlocked('"', out);
+    fputs_unlocked(value, out);
+    putc_unlocked('"', out);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <rows> [template.csv] [seed]\n", argv[0]);
+        return 1;
+    }
+    long long rows = atoll(argv[1]);
+    const char *template_file = argc > 2 ? argv[2] : "county_demographics.csv";
+    rng_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 357;
+    if (rng_state == 0) rng_state = 1;
+
+    FILE *fp = fopen(template_file, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open template file '%s'\n", template_file);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    if (getline(&line, &line_cap, fp) < 0) {
+        fprintf(stderr, "Error: Template file is empty.\n");
+        fclose(fp);
+        return 1;
+    }
+    char *header[MAX_FIELDS];
+    char *header_line = strdup(line);
+    int num_fields = split_line(header_line, header);
+
+    TemplateRow *templates = NULL;
+    int num_templates = 0, capacity = 0;
+    while (getline(&line, &line_cap, fp) >= 0) {
+        if (num_templates == capacity) {
+            capacity = capacity ? capacity*2 : 4096;
+            TemplateRow *p = realloc(templates, sizeof(TemplateRow)*capacity);
+            if (!p) break;
+            templates = p;
+        }
+        TemplateRow *t = &templates[num_templates];
+        t->line = strdup(line);
+        t->count = t->line ? split_line(t->line, t->fields) : 0;
+        if (t->count != num_fields) {
+            free(t->line);
+            continue;
+        }
+        for (int k=0; k<num_fields; k++) {
+            // The first column is the county name, even if it looks numeric
+            t->decimals[k] = k == 0 ? -1 : number_decimals(t->fields[k]);
+            t->values[k] = t->decimals[k] >= 0 ? atof(t->fields[k]) : 0.0;
+        }
+        num_templates++;
+    }
+    fclose(fp);
+    free(line);
+    if (num_templates == 0) {
+        fprintf(stderr, "Error: Template file has no complete rows.\n");
+        return 1;
+    }
+
+    for (int k=0; k<num_fields; k++) {
+        if (k) putc_unlocked(',', stdout);
+        write_field(header[k], stdout);
+    }
+    putc_unlocked('\n', stdout);
+
+    char value[64];
+    for (long long r=0; r<rows; r++) {
+        const TemplateRow *t = &templates[next_random() % (uint64_t)num_templates];
+        for (int k=0; k<num_fields; k++) {
+            if (k) putc_unlocked(',', stdout);
+            int decimals = t->decimals[k];
+            if (k == 0) {
+                snprintf(value, sizeof(value), "%.40s %lld", t->fields[k], r);
+            } else if (decimals >= 0) {
+                double original = t->values[k];
+                double v = original * (0.9 + 0.2*random_unit());
+                // Percentages stay percentages
+                if (decimals > 0 && original >= 0.0 && original <= 100.0 && v > 100.0) v = 100.0;
+                format_fixed(value, v, decimals);
+            } else {
+                write_field(t->fields[k], stdout);
+                continue;
+            }
+            write_field(value, stdout);
+        }
+        putc_unlocked('\n', stdout);
+    }
+
+    for (int i=0; i<num_templates; i++) free(templates[i].line);
+    free(templates);
+    free(header_line);
+    return fflush(stdout) == 0 ? 0 : 1;
+}
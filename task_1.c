@@ -4,58 +4,422 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
+typedef enum {
+    COL_UNKNOWN,    // not decided yet; settled by the first non-blank value
+    COL_STRING,     // one string per row, pointing into the input buffer
+    COL_INTERNED,   // per-row id into the column's dictionary
+    COL_INT,
+    COL_FLOAT
+} ColumnType;
+
+/* Hashed set of strings; each distinct string gets a dense id in insertion order */
 typedef struct {
-    char *county;
-    char *state;
-    float edu_bachelors;
-    float edu_hs;
-    float eth_ai;
-    float eth_asian;
-    float eth_black;
-    float eth_hisp;
-    float eth_nhpi;
-    float eth_2more;
-    float eth_white;
-    float eth_white_non_hisp;
-    int income_median;
-    int income_percap;
-    float income_poverty;
-    int pop_2014;
-    int active;
-} CountyRecord;
-
-typedef struct {
-    int idx_county;
-    int idx_state;
-    int idx_edu_bachelors;
-    int idx_edu_hs;
-    int idx_eth_ai;
-    int idx_eth_asian;
-    int idx_eth_black;
-    int idx_eth_hisp;
-    int idx_eth_nhpi;
-    int idx_eth_2more;
-    int idx_eth_white;
-    int idx_eth_white_non_hisp;
-    int idx_inc_median;
-    int idx_inc_percap;
-    int idx_inc_pov;
-    int idx_pop_2014;
-} FieldIndices;
-
-/* Safe string trimming function */
-static void trim_whitespace(char *s) {
-    char *start = s;
-    while (isspace((unsigned char)*start)) start++;
-    if (start != s) {
-        memmove(s, start, strlen(start)+1);
-    }
-
-    char *end = s + strlen(s) - 1;
-    while (end > s && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-}
+    char **strings;
+    int count;
+    int capacity;
+    int *slots;         // open-addressing table of ids, -1 when empty
+    int num_slots;
+} StringDict;
+
+/* One column of the table. Only the array matching 'type' is allocated. */
+typedef struct {
+    const char *name;
+    ColumnType type;
+    int pinned;         // type fixed by name rather than inferred from the data
+    int required;       // a value that is not a number rejects the row; otherwise it is kept as NaN
+    char **s;           // COL_STRING values, and the raw fields while COL_UNKNOWN
+    int *codes;
+    int *i;
+    float *f;
+    StringDict dict;    // COL_INTERNED values
+    int *order;         // index, when built: row ids sorted by value, or grouped by code
+    int *code_start;    // COL_INTERNED index: rows of code c are order[code_start[c]..code_start[c+1])
+} Column;
+
+/* Columnar record store with a schema taken from the CSV header */
+typedef struct {
+    int count;
+    int capacity;
+    int num_columns;
+    Column *columns;
+    StringDict column_names;    // name id == column index
+    int col_county;
+    int col_state;
+    int col_pop;
+    char *buffer;               // input file; string columns point into it
+    size_t buffer_len;
+    int buffer_mapped;          // buffer came from mmap rather than malloc
+    int borrowed_columns;       // i/f/codes arrays point into buffer (snapshot)
+    int borrowed_indexes;       // order/code_start arrays point into buffer
+    int defer_types;            // parse part: COL_UNKNOWN columns keep raw fields for dataset_append_part
+} Dataset;
+
+/* One newline-aligned slice of the input, parsed by its own thread */
+typedef struct {
+    Dataset *part;      // rows parsed from this slice
+    char *start;
+    char *end;
+    const int *field_to_column;
+    int num_fields;
+    int num_lines;      // records seen, well-formed or not
+    int *bad_lines;     // record index within the slice of each malformed line
+    int num_bad;
+    int bad_capacity;
+    int error;          // set on allocation failure
+} ParseChunk;
+
+/* Binary columnar snapshot. All offsets are from the start of the file and
+ * every section starts 8-byte aligned; values are in host byte order. */
+#define SNAPSHOT_MAGIC "DEMOSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ENDIAN 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;            // SNAPSHOT_ENDIAN as written by the producing host
+    uint64_t file_size;
+    uint64_t checksum;          // over every byte after this header
+    uint64_t source_size;       // size and mtime of the CSV the snapshot was built from
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    int32_t num_rows;
+    int32_t num_columns;
+    uint64_t source_path;       // NUL-terminated path of that CSV
+    uint64_t directory;         // num_columns SnapshotColumn entries
+    uint64_t joins;             // num_joins SnapshotJoin entries
+    int32_t num_joins;
+    int32_t indexed;            // built with --index
+} SnapshotHeader;
+
+/* A --join applied before the snapshot was written, kept so that a stale
+ * snapshot can be rebuilt with the same columns */
+typedef struct {
+    uint64_t spec;              // NUL-terminated --join argument, with the file's absolute path
+    uint64_t size;              // size and mtime of the join file
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} SnapshotJoin;
+
+/* What a stale snapshot was built from */
+typedef struct {
+    char *source;
+    char **joins;
+    int num_joins;
+    int indexed;
+} SnapshotOrigin;
+
+typedef struct {
+    uint64_t name;              // NUL-terminated column name
+    uint32_t type;
+    uint32_t pinned;
+    uint64_t data;              // num_rows values; strings store num_rows+1 offsets into 'strings'
+    uint64_t strings;           // COL_STRING values or the COL_INTERNED dictionary
+    uint64_t dict;              // COL_INTERNED: dict_count+1 offsets into 'strings'
+    int32_t dict_count;
+    int32_t reserved;
+    uint64_t index;             // Column.order as num_rows row ids, 0 when not indexed
+    uint64_t index_starts;      // COL_INTERNED index: dict_count+1 Column.code_start entries
+} SnapshotColumn;
+
+typedef struct {
+    FILE *fp;
+    uint64_t offset;
+    uint64_t hash;
+} SnapshotWriter;
+
+/* Inputs smaller than this per thread are not worth splitting */
+#ifndef MIN_CHUNK_BYTES
+#define MIN_CHUNK_BYTES (1 << 20)
+#endif
+
+#define MAX_THREADS 64
+
+/* --threads=N; 0 means one per online CPU */
+static int thread_limit;
+
+/* Set by --bench, which loads the data repeatedly */
+static int quiet_load;
+
+/* Set by --format=jsonl: load and snapshot messages then go to stderr so
+ * that stdout holds only JSON */
+static int load_to_stderr;
+#define LOAD_LOG (load_to_stderr ? stderr : stdout)
+
+/* Longest run of aggregate ops evaluated in a single pass */
+#define MAX_FUSED_OPS 64
+
+/* Bytes of record output collected before each write to the stream */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSONL
+} OutputFormat;
+
+/* Record writer for display, top: and sort:. Values are formatted straight
+ * into buf, which is handed to fp whenever it fills and after each op. */
+typedef struct {
+    FILE *fp;
+    FILE *err;
+    OutputFormat format;
+    size_t len;
+    long long written;  // bytes handed to fp so far
+    char buf[OUTPUT_BUFFER_SIZE];
+} Output;
+
+/* Selection bitmap: bit i is set while row i is active */
+typedef struct {
+    uint64_t *bits;
+    int count;
+    int num_words;
+} Selection;
+
+/* A resolved numeric column: exactly one of f/i is set */
+typedef struct {
+    const float *f;
+    const int *i;
+    const int *order;   // row ids sorted by value, NULL without an index
+} ColumnRef;
+
+typedef enum {
+    OP_DISPLAY,
+    OP_TOP,
+    OP_SORT,
+    OP_FILTER,
+    OP_PUSH,
+    OP_POP,
+    OP_SAVE,
+    OP_RESTORE,
+    OP_RESET,
+    OP_GROUP_BY,
+    OP_POPULATION_TOTAL,
+    OP_POPULATION_SUB,
+    OP_PERCENT,
+    OP_QUANTILE,        // median: and quantile:
+    OP_HISTOGRAM
+} OpKind;
+
+typedef enum {
+    CMP_GE,
+    CMP_LE,
+    CMP_GT,
+    CMP_LT,
+    CMP_EQ,
+    CMP_NE
+} Comparison;
+
+typedef enum {
+    MATCH_EQ,
+    MATCH_NE,
+    MATCH_IN,
+    MATCH_PREFIX,
+    MATCH_CONTAINS
+} StringMatch;
+
+typedef enum {
+    PRED_AND,
+    PRED_OR,
+    PRED_NOT,
+    PRED_NUMERIC,       // numeric column compared against a number
+    PRED_CODES,         // interned column, matched through a per-id table
+    PRED_STRING         // plain string column, matched row by row
+} PredicateKind;
+
+/* Compiled filter expression; each leaf is evaluated a whole column at a time */
+typedef struct Predicate {
+    PredicateKind kind;
+    struct Predicate *left;     // AND/OR operands; NOT uses left only
+    struct Predicate *right;
+    ColumnRef column;
+    Comparison cmp;
+    float number;
+    const int *codes;           // PRED_CODES column ids
+    const int *code_rows;       // PRED_CODES index of the column, NULL without one
+    const int *code_start;
+    int num_codes;
+    char *const *strings;       // PRED_STRING column values
+    StringMatch match;
+    char **values;              // PRED_STRING arguments
+    int num_values;
+    unsigned char *code_match;  // PRED_CODES: nonzero for dictionary ids that match
+} Predicate;
+
+/* group-by key: interned columns group on their dictionary ids, numeric
+ * columns on buckets of floor(value/width). column is NULL when ungrouped. */
+typedef struct {
+    const Column *column;
+    ColumnRef values;
+    double width;
+} GroupKey;
+
+/* Per-group accumulators of an aggregate run */
+typedef struct {
+    long long total_pop;
+    int count;
+    int code;           // dictionary id, or -1 for a numeric bucket
+    long long bucket;
+} GroupTotals;
+
+/* Groups seen by one aggregate run; numeric buckets are found through a
+ * small open-addressed table, dictionary ids index groups directly */
+typedef struct {
+    GroupTotals *groups;
+    double *sums;               // count x num_ops, one row per group
+    long long *missing;         // count x num_ops, population of rows whose field is missing (NaN)
+    int count;
+    int capacity;
+    int num_ops;
+    long long *bucket_keys;
+    int *bucket_ids;
+    int num_slots;
+} GroupTable;
+
+/* --profile: what one step cost. A step is the load, the index build or
+ * one op line; a run of fused aggregate lines is a single step. */
+#define PROFILE_TEXT 48
+
+typedef struct {
+    char text[PROFILE_TEXT];    // the op line as written, cut to fit
+    int first_line;             // 0 for the load and the index build
+    int last_line;
+    double seconds;             // profile_begin keeps starting values in
+    long long heap_change;      // seconds, heap_change and bytes_written
+    long long bytes_written;
+    long long rows_scanned;     // active rows when the step started
+    long long rows_selected;    // active rows when it ended
+    long long bytes_read;       // column data the step reads, from the widths of its inputs
+    long peak_rss_kb;           // peak RSS of the process once the step is done
+} ProfileStep;
+
+typedef struct {
+    ProfileStep *steps;
+    int count;
+    int capacity;
+    int json;                   // --profile=json; otherwise a table
+} Profile;
+
+/* Selection state of one ops script: the current selection plus the scopes
+ * saved by push and save, so later lines can return to a wider selection */
+typedef struct {
+    Selection sel;
+    Selection *stack;           // push/pop
+    int depth;
+    int stack_capacity;
+    StringDict saved_names;     // save/restore; name id indexes saved
+    Selection *saved;
+    GroupKey group;             // group-by applied to aggregate ops
+    char group_name[256];
+    Output *out;
+    Profile *profile;           // NULL unless --profile
+} QueryState;
+
+/* One compiled line of an ops file */
+typedef struct {
+    OpKind kind;
+    int line_num;
+    char name[256];     // field or selection name as written, used for output
+    ColumnRef column;
+    Predicate *pred;    // OP_FILTER
+    char *label;        // OP_FILTER: description printed with the entry count
+    GroupKey group;     // OP_GROUP_BY; an empty key ends grouping
+    int limit;          // OP_TOP: number of rows kept
+    int descending;     // OP_TOP, OP_SORT
+    int *fields;        // OP_DISPLAY projection, NULL for the full record
+    int num_fields;
+    double quantile;    // OP_QUANTILE: fraction of the rows (or population) at or below the result
+    int buckets;        // OP_HISTOGRAM
+    int weighted;       // OP_QUANTILE, OP_HISTOGRAM: count population rather than rows
+    int approximate;    // OP_QUANTILE, OP_HISTOGRAM: read from a QuantileSketch
+} Operation;
+
+/* Mergeable quantile sketch with logarithmic bins, as in DDSketch: each
+ * value is counted in a bin SKETCH_ALPHA wide relative to its magnitude, so
+ * a quantile read back is within that fraction of the exact one. The size
+ * is fixed whatever the row count, and sketches merge by adding bins. */
+#define SKETCH_ALPHA 0.01
+#define SKETCH_GAMMA ((1.0 + SKETCH_ALPHA)/(1.0 - SKETCH_ALPHA))
+#define SKETCH_MIN_VALUE 1e-6   // smaller magnitudes count as zero
+#define SKETCH_BINS 5200        // reaches past FLT_MAX
+
+typedef struct {
+    long long positive[SKETCH_BINS];
+    long long negative[SKETCH_BINS];    // by magnitude
+    long long zero;
+    long long total;        // sum of weights
+    long long count;        // values added
+    float min;
+    float max;
+} QuantileSketch;
+
+#define MAX_HISTOGRAM_BUCKETS 1000
+
+/* Columns every demographics file must provide; display prints all of them */
+static const char *const required_columns[] = {
+    "County",
+    "State",
+    "Education.Bachelor's Degree or Higher",
+    "Education.High School or Higher",
+    "Ethnicities.American Indian and Alaska Native Alone",
+    "Ethnicities.Asian Alone",
+    "Ethnicities.Black Alone",
+    "Ethnicities.Hispanic or Latino",
+    "Ethnicities.Native Hawaiian and Other Pacific Islander Alone",
+    "Ethnicities.Two or More Races",
+    "Ethnicities.White Alone",
+    "Ethnicities.White Alone not Hispanic or Latino",
+    "Income.Median Household Income",
+    "Income.Per Capita Income",
+    "Income.Persons Below Poverty Level",
+    "Population.2014 Population"
+};
+
+/* Fields of a full record in display order, as written by csv and jsonl */
+static const char *const display_fields[] = {
+    "County",
+    "State",
+    "Population.2014 Population",
+    "Education.High School or Higher",
+    "Education.Bachelor's Degree or Higher",
+    "Ethnicities.American Indian and Alaska Native Alone",
+    "Ethnicities.Asian Alone",
+    "Ethnicities.Black Alone",
+    "Ethnicities.Hispanic or Latino",
+    "Ethnicities.Native Hawaiian and Other Pacific Islander Alone",
+    "Ethnicities.Two or More Races",
+    "Ethnicities.White Alone",
+    "Ethnicities.White Alone not Hispanic or Latino",
+    "Income.Median Household Income",
+    "Income.Per Capita Income",
+    "Income.Persons Below Poverty Level"
+};
+
+#define NUM_DISPLAY_FIELDS ((int)(sizeof(display_fields)/sizeof(display_fields[0])))
+
+/* Names accepted in ops files in place of the header spelling */
+static const char *const column_aliases[][2] = {
+    {"Ethnicities.White Alone, not Hispanic or Latino", "Ethnicities.White Alone not Hispanic or Latino"},
+};
 
 /* Convert string to float */
 static int convert_to_float(const char *str, float *val) {
@@ -77,497 +441,4893 @@ static int convert_to_int(const char *str, int *val) {
     return 0;
 }
 
-/* Find the index of a column by name in the already trimmed headers */
-static int find_header_index(char **headers, int count, const char *name) {
-    for (int i=0; i<count; i++) {
-        if (strcmp(headers[i], name) == 0) {
-            return i;
+/* Narrowest numeric type that holds str, or COL_STRING when it is not a number */
+static ColumnType classify_value(const char *str) {
+    if (!*str) return COL_STRING;
+    char *end;
+    strtol(str, &end, 10);
+    if (end != str && *end != '.' && *end != 'e' && *end != 'E') return COL_INT;
+    strtof(str, &end);
+    return end != str ? COL_FLOAT : COL_STRING;
+}
+
+/* Classify and convert a field in one pass. Plain decimals take a fast path:
+ * up to 9 digits are exact in the accumulator, and with a mantissa below 2^24
+ * and at most 10 fraction digits both operands of the division are exact
+ * floats, so the single rounding matches strtof. Anything else falls back to
+ * classify_value and the strto* converters. */
+static ColumnType parse_number(const char *str, int *ival, float *fval) {
+    static const float pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const char *p = str;
+    int neg = (*p == '-');
+    if (neg) p++;
+    uint32_t m = 0;
+    int digits = 0, frac = -1;
+    for (;; p++) {
+        if (*p >= '0' && *p <= '9') {
+            m = m*10 + (uint32_t)(*p - '0');
+            digits++;
+            if (frac >= 0) frac++;
+        } else if (*p == '.' && frac < 0) {
+            frac = 0;
+        } else {
+            break;
+        }
+    }
+
+    if (*p == '\0' && digits > 0 && digits <= 9) {
+        if (frac < 0) {
+            *ival = neg ? -(int)m : (int)m;
+            *fval = neg ? -(float)m : (float)m;
+            return COL_INT;
+        }
+        if (m <= (1u << 24) && frac <= 10) {
+            float f = (float)m / pow10f[frac];
+            *fval = neg ? -f : f;
+            return COL_FLOAT;
         }
     }
-    return -1;
+
+    ColumnType type = classify_value(str);
+    if (type == COL_INT) {
+        convert_to_int(str, ival);
+        *fval = (float)*ival;
+    } else if (type == COL_FLOAT) {
+        convert_to_float(str, fval);
+    }
+    return type;
 }
 
-static int is_numeric_field(const char *f) {
-    if (strcmp(f, "County") == 0 || strcmp(f, "State") == 0) {
-        return 0;
+/* FNV-1a */
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
     }
-    return 1;
+    return h;
 }
 
-static int is_population_subfield(const char *f) {
-    if (strncmp(f, "Education.", 10) == 0) return 1;
-    if (strncmp(f, "Ethnicities.", 12) == 0) return 1;
-    if (strcmp(f, "Income.Persons Below Poverty Level") == 0) return 1;
-    return 0;
+/* Id of s in the dictionary, or -1 */
+static int dict_find(const StringDict *d, const char *s) {
+    if (!d->num_slots) return -1;
+    uint32_t mask = (uint32_t)d->num_slots - 1;
+    for (uint32_t slot = hash_string(s) & mask; d->slots[slot] >= 0; slot = (slot+1) & mask) {
+        if (strcmp(d->strings[d->slots[slot]], s) == 0) {
+            return d->slots[slot];
+        }
+    }
+    return -1;
 }
 
-/* Parse a CSV line into a CountyRecord */
-static int parse_csv_line(char *line, int line_num, FieldIndices *fi, CountyRecord *rec) {
-    char *fields[200];
-    int count = 0;
-    char *tmp = line;
-    char *token;
-    while ((token = strsep(&tmp, ",")) != NULL) {
-        // Just trim whitespace here; CSV fields may be quoted fields from the dataset
-        trim_whitespace(token);
-        // Remove surrounding quotes if present
-        size_t len = strlen(token);
-        if (len > 1 && token[0] == '"' && token[len-1] == '"') {
-            token[len-1] = '\0';
-            memmove(token, token+1, strlen(token)); 
-        }
-        fields[count++] = token;
-    }
-
-    const int required_indices[] = {
-        fi->idx_county,
-        fi->idx_state,
-        fi->idx_edu_bachelors,
-        fi->idx_edu_hs,
-        fi->idx_eth_ai,
-        fi->idx_eth_asian,
-        fi->idx_eth_black,
-        fi->idx_eth_hisp,
-        fi->idx_eth_nhpi,
-        fi->idx_eth_2more,
-        fi->idx_eth_white,
-        fi->idx_eth_white_non_hisp,
-        fi->idx_inc_median,
-        fi->idx_inc_percap,
-        fi->idx_inc_pov,
-        fi->idx_pop_2014
-    };
-
-    int num_required_fields = (int)(sizeof(required_indices)/sizeof(required_indices[0]));
-    for (int i = 0; i < num_required_fields; i++) {
-        if (required_indices[i] < 0 || required_indices[i] >= count) {
-            return -1;  // Invalid field index
-        }
-    }
-
-    rec->county = strdup(fields[fi->idx_county]);
-    rec->state = strdup(fields[fi->idx_state]);
-
-    if (convert_to_float(fields[fi->idx_edu_bachelors], &rec->edu_bachelors) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_edu_hs], &rec->edu_hs) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_ai], &rec->eth_ai) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_asian], &rec->eth_asian) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_black], &rec->eth_black) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_hisp], &rec->eth_hisp) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_nhpi], &rec->eth_nhpi) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_2more], &rec->eth_2more) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_white], &rec->eth_white) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_eth_white_non_hisp], &rec->eth_white_non_hisp) < 0) return -1;
-    if (convert_to_int(fields[fi->idx_inc_median], &rec->income_median) < 0) return -1;
-    if (convert_to_int(fields[fi->idx_inc_percap], &rec->income_percap) < 0) return -1;
-    if (convert_to_float(fields[fi->idx_inc_pov], &rec->income_poverty) < 0) return -1;
-    if (convert_to_int(fields[fi->idx_pop_2014], &rec->pop_2014) < 0) return -1;
-
-    rec->active = 1;
-    return 0;
-}
-
-static CountyRecord *load_demographics(const char *filename, int *num_records) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open demographics file '%s'\n", filename);
-        return NULL;
+static int dict_rehash(StringDict *d, int num_slots) {
+    int *slots = malloc(sizeof(int)*num_slots);
+    if (!slots) return -1;
+    for (int i=0; i<num_slots; i++) slots[i] = -1;
+    uint32_t mask = (uint32_t)num_slots - 1;
+    for (int id=0; id<d->count; id++) {
+        uint32_t slot = hash_string(d->strings[id]) & mask;
+        while (slots[slot] >= 0) slot = (slot+1) & mask;
+        slots[slot] = id;
     }
+    free(d->slots);
+    d->slots = slots;
+    d->num_slots = num_slots;
+    return 0;
+}
 
-    char line[10240];
-    // Read header line
-    if (!fgets(line, sizeof(line), fp)) {
-        fprintf(stderr, "Error: Demographics file is empty.\n");
-        fclose(fp);
-        return NULL;
+/* Return the id of s, adding a copy on first sight */
+static int dict_intern(StringDict *d, const char *s) {
+    int id = dict_find(d, s);
+    if (id >= 0) return id;
+
+    if ((d->count+1)*2 > d->num_slots) {
+        if (dict_rehash(d, d->num_slots ? d->num_slots*2 : 64) < 0) return -1;
+    }
+    if (d->count >= d->capacity) {
+        int capacity = d->capacity ? d->capacity*2 : 32;
+        char **p = realloc(d->strings, sizeof(char*)*capacity);
+        if (!p) return -1;
+        d->strings = p;
+        d->capacity = capacity;
     }
+    char *copy = strdup(s);
+    if (!copy) return -1;
 
-    // Parse header
-    char *headers[200];
-    int hcount = 0;
-    {
-        char *tmp = line;
-        char *token;
-        while ((token = strsep(&tmp, ",")) != NULL) {
-            trim_whitespace(token);
-            // Remove surrounding quotes if present
-            size_t len = strlen(token);
-            if (len > 1 && token[0] == '"' && token[len-1] == '"') {
-                token[len-1] = '\0';
-                memmove(token, token+1, strlen(token));
-            }
-            headers[hcount++] = strdup(token);
-        }
-    }
-
-    // Debug prints for headers
-    /*
-    printf("Found %d headers:\n", hcount);
-    for (int i = 0; i < hcount; i++) {
-        printf("Header %d: '%s'\n", i, headers[i]);
-    }
-    */
-
-    FieldIndices fi;
-    fi.idx_county = find_header_index(headers, hcount, "County");
-    fi.idx_state = find_header_index(headers, hcount, "State");
-    fi.idx_edu_bachelors = find_header_index(headers, hcount, "Education.Bachelor's Degree or Higher");
-    fi.idx_edu_hs = find_header_index(headers, hcount, "Education.High School or Higher");
-    fi.idx_eth_ai = find_header_index(headers, hcount, "Ethnicities.American Indian and Alaska Native Alone");
-    fi.idx_eth_asian = find_header_index(headers, hcount, "Ethnicities.Asian Alone");
-    fi.idx_eth_black = find_header_index(headers, hcount, "Ethnicities.Black Alone");
-    fi.idx_eth_hisp = find_header_index(headers, hcount, "Ethnicities.Hispanic or Latino");
-    fi.idx_eth_nhpi = find_header_index(headers, hcount, "Ethnicities.Native Hawaiian and Other Pacific Islander Alone");
-    fi.idx_eth_2more = find_header_index(headers, hcount, "Ethnicities.Two or More Races");
-    fi.idx_eth_white = find_header_index(headers, hcount, "Ethnicities.White Alone");
-    fi.idx_eth_white_non_hisp = find_header_index(headers, hcount, "Ethnicities.White Alone not Hispanic or Latino");
-    fi.idx_inc_median = find_header_index(headers, hcount, "Income.Median Household Income");
-    fi.idx_inc_percap = find_header_index(headers, hcount, "Income.Per Capita Income");
-    fi.idx_inc_pov = find_header_index(headers, hcount, "Income.Persons Below Poverty Level");
-    fi.idx_pop_2014 = find_header_index(headers, hcount, "Population.2014 Population");
+    uint32_t mask = (uint32_t)d->num_slots - 1;
+    uint32_t slot = hash_string(s) & mask;
+    while (d->slots[slot] >= 0) slot = (slot+1) & mask;
+    d->slots[slot] = d->count;
+    d->strings[d->count] = copy;
+    return d->count++;
+}
 
-    // Check if any required field is missing
-    int *fields_array = (int*)&fi;
-    for (int i=0; i<16; i++) {
-        if (fields_array[i] < 0) {
-            fprintf(stderr, "Error: Missing required column in demographics file.\n");
-            fclose(fp);
-            return NULL;
-        }
+static void dict_free(StringDict *d) {
+    for (int i=0; i<d->count; i++) {
+        free(d->strings[i]);
     }
+    free(d->strings);
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
 
-    int capacity = 5000;
-    CountyRecord *records = malloc(sizeof(CountyRecord)*capacity);
-    int count = 0;
-    int line_num = 1; // header is line 1
-    while (fgets(line, sizeof(line), fp)) {
-        line_num++;
-        if (count >= capacity) {
-            capacity *= 2;
-            records = realloc(records, sizeof(CountyRecord)*capacity);
-        }
-        CountyRecord temp;
-        if (parse_csv_line(line, line_num, &fi, &temp) == 0) {
-            records[count++] = temp;
-        } else {
-            fprintf(stderr, "Error: Malformed line %d in demographics file. Skipping.\n", line_num);
+/* Look up a column by header name or alias, or -1 */
+static int find_column(const Dataset *ds, const char *name) {
+    int id = dict_find(&ds->column_names, name);
+    if (id >= 0) return id;
+    for (size_t a=0; a<sizeof(column_aliases)/sizeof(column_aliases[0]); a++) {
+        if (strcmp(column_aliases[a][0], name) == 0) {
+            return dict_find(&ds->column_names, column_aliases[a][1]);
         }
     }
+    return -1;
+}
 
-    fclose(fp);
-
-    *num_records = count;
-    printf("%d records loaded\n", count);
+static int is_numeric_column(const Column *c) {
+    return c->type == COL_INT || c->type == COL_FLOAT;
+}
 
-    for (int i = 0; i < hcount; i++) {
-        free(headers[i]);
+static ColumnRef resolve_column(const Dataset *ds, int column) {
+    ColumnRef ref = {NULL, NULL, NULL};
+    const Column *c = &ds->columns[column];
+    ref.order = c->order;
+    if (c->type == COL_INT) {
+        ref.i = c->i;
+    } else {
+        ref.f = c->f;
     }
+    return ref;
+}
 
-    return records;
+/* Read row i of a resolved column; the type test is loop-invariant */
+static inline float column_value(ColumnRef col, int i) {
+    return col.f ? col.f[i] : (float)col.i[i];
 }
 
+/* Allocate or grow the storage of one column to 'capacity' rows */
+static int column_reserve(Column *c, int capacity) {
+    void *p;
+    switch (c->type) {
+    case COL_UNKNOWN:
+    case COL_STRING:
+        p = realloc(c->s, sizeof(char*)*capacity);
+        if (!p) return -1;
+        c->s = p;
+        break;
+    case COL_INTERNED:
+        p = realloc(c->codes, sizeof(int)*capacity);
+        if (!p) return -1;
+        c->codes = p;
+        break;
+    case COL_INT:
+        p = realloc(c->i, sizeof(int)*capacity);
+        if (!p) return -1;
+        c->i = p;
+        break;
+    case COL_FLOAT:
+        p = realloc(c->f, sizeof(float)*capacity);
+        if (!p) return -1;
+        c->f = p;
+        break;
+    }
+    return 0;
+}
 
-/* display: print all active records */
-static void op_display(CountyRecord *records, int count) {
-    for (int i=0; i<count; i++) {
-        if (records[i].active) {
-            printf("%s, %s\n", records[i].county, records[i].state);
-            printf("        Population: %d\n", records[i].pop_2014);
-            printf("        Education\n");
-            printf("                >= High School: %f%%\n", records[i].edu_hs);
-            printf("                >= Bachelor's: %f%%\n", records[i].edu_bachelors);
-            printf("        Ethnicity Percentages\n");
-            printf("                American Indian and Alaska Native: %f%%\n", records[i].eth_ai);
-            printf("                Asian Alone: %f%%\n", records[i].eth_asian);
-            printf("                Black Alone: %f%%\n", records[i].eth_black);
-            printf("                Hispanic or Latino: %f%%\n", records[i].eth_hisp);
-            printf("                Native Hawaiian and Other Pacific Islander Alone: %f%%\n", records[i].eth_nhpi);
-            printf("                Two or More Races: %f%%\n", records[i].eth_2more);
-            printf("                White Alone: %f%%\n", records[i].eth_white);
-            printf("                White Alone, not Hispanic or Latino: %f%%\n", records[i].eth_white_non_hisp);
-            printf("        Income\n");
-            printf("                Median Household: %d\n", records[i].income_median);
-            printf("                Per Capita: %d\n", records[i].income_percap);
-            printf("                Below Poverty Level: %f%%\n", records[i].income_poverty);
-            printf("\n");
-        }
+/* Grow every column so that at least 'needed' rows fit */
+static int dataset_reserve(Dataset *ds, int needed) {
+    if (needed <= ds->capacity) return 0;
+    int capacity = ds->capacity ? ds->capacity : 5000;
+    while (capacity < needed) capacity *= 2;
+    for (int c=0; c<ds->num_columns; c++) {
+        if (column_reserve(&ds->columns[c], capacity) < 0) return -1;
     }
+    ds->capacity = capacity;
+    return 0;
 }
 
-/* filter-state:<state abbreviation> */
-static void op_filter_state(CountyRecord *records, int count, const char *state_abbr) {
-    int remain = 0;
-    for (int i=0; i<count; i++) {
-        if (records[i].active && strcmp(records[i].state, state_abbr) == 0) {
-            remain++;
-        } else {
-            records[i].active = 0;
-        }
-    }
-    printf("Filter: state == %s (%d entries)\n", state_abbr, remain);
-}
-
-/* filter:<field>:<ge/le>:<number> */
-static void op_filter_numeric(CountyRecord *records, int count, const char *field, const char *op, float number) {
-    int remain = 0;
-    for (int i=0; i<count; i++) {
-        if (!records[i].active) continue;
-        float val;
-        if (strcmp(field, "Education.Bachelor's Degree or Higher") == 0) val = records[i].edu_bachelors;
-        else if (strcmp(field, "Education.High School or Higher") == 0) val = records[i].edu_hs;
-        else if (strcmp(field, "Ethnicities.American Indian and Alaska Native Alone") == 0) val = records[i].eth_ai;
-        else if (strcmp(field, "Ethnicities.Asian Alone") == 0) val = records[i].eth_asian;
-        else if (strcmp(field, "Ethnicities.Black Alone") == 0) val = records[i].eth_black;
-        else if (strcmp(field, "Ethnicities.Hispanic or Latino") == 0) val = records[i].eth_hisp;
-        else if (strcmp(field, "Ethnicities.Native Hawaiian and Other Pacific Islander Alone") == 0) val = records[i].eth_nhpi;
-        else if (strcmp(field, "Ethnicities.Two or More Races") == 0) val = records[i].eth_2more;
-        else if (strcmp(field, "Ethnicities.White Alone") == 0) val = records[i].eth_white;
-        else if (strcmp(field, "Ethnicities.White Alone, not Hispanic or Latino") == 0) val = records[i].eth_white_non_hisp;
-        else if (strcmp(field, "Income.Median Household Income") == 0) val = (float)records[i].income_median;
-        else if (strcmp(field, "Income.Per Capita Income") == 0) val = (float)records[i].income_percap;
-        else if (strcmp(field, "Income.Persons Below Poverty Level") == 0) val = records[i].income_poverty;
-        else if (strcmp(field, "Population.2014 Population") == 0) val = (float)records[i].pop_2014;
-        else {
-            // Field not found
-            fprintf(stderr, "Warning: filter: field '%s' not found or not numeric.\n", field);
-            return;
-        }
+/* Widen an int column to float once a fractional value shows up */
+static int column_promote_to_float(Column *c, int rows, int capacity) {
+    float *f = malloc(sizeof(float)*(capacity ? capacity : 1));
+    if (!f) return -1;
+    for (int r=0; r<rows; r++) {
+        f[r] = (float)c->i[r];
+    }
+    free(c->i);
+    c->i = NULL;
+    c->f = f;
+    c->type = COL_FLOAT;
+    return 0;
+}
 
-        int keep = 0;
-        if (strcmp(op, "ge") == 0) {
-            if (val >= number) keep = 1;
-        } else if (strcmp(op, "le") == 0) {
-            if (val <= number) keep = 1;
+/* Tokenize one CSV record in place, starting at *pos. Each field is trimmed,
+ * unquoted (a doubled quote inside quotes is a literal quote) and NUL-terminated
+ * inside the buffer. Quoted fields may contain commas but not newlines. The buffer
+ * must end with a newline. Fields past max_fields are skipped. On return *pos is
+ * the start of the next record. Returns the number of fields, or -1 if a quote is
+ * left open. */
+static int tokenize_record(char **pos, char **fields, int max_fields) {
+    char *p = *pos;
+    int count = 0;
+    int status = 0;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        char *start = p;
+        char *out;
+        if (*p == '"') {
+            // Compact the quoted body leftwards over its opening quote
+            start = out = p++;
+            for (;;) {
+                if (*p == '\n') {
+                    status = -1;
+                    break;
+                }
+                if (*p == '"') {
+                    if (p[1] != '"') {
+                        p++;
+                        break;
+                    }
+                    p++;
+                }
+                *out++ = *p++;
+            }
+            while (*p != ',' && *p != '\n') p++;
         } else {
-            fprintf(stderr, "Warning: filter: invalid operator '%s'.\n", op);
-            return;
+            while (*p != ',' && *p != '\n') p++;
+            out = p;
+            while (out > start && isspace((unsigned char)out[-1])) out--;
         }
 
-        if (!keep) {
-            records[i].active = 0;
-        } else {
-            remain++;
+        char delim = *p;
+        *out = '\0';
+        if (count < max_fields) {
+            fields[count] = start;
         }
+        count++;
+        p++;
+        if (delim == '\n') break;
     }
+    *pos = p;
+    return status < 0 ? -1 : count;
+}
 
-    printf("Filter: %s %s %f (%d entries)\n", field, op, number, remain);
+/* Type a COL_UNKNOWN column; its earlier, blank rows stay text or become NaN floats */
+static int column_settle(Column *c, ColumnType type, int rows, int capacity) {
+    if (type == COL_STRING) {
+        c->type = COL_STRING;
+        return 0;
+    }
+    free(c->s);
+    c->s = NULL;
+    c->type = type == COL_INT && rows > 0 ? COL_FLOAT : type;
+    if (capacity && column_reserve(c, capacity) < 0) return -1;
+    for (int r=0; r<rows; r++) {
+        c->f[r] = NAN;
+    }
+    return 0;
 }
 
-/* population-total */
-static void op_population_total(CountyRecord *records, int count) {
-    long long total = 0;
-    for (int i=0; i<count; i++) {
-        if (records[i].active) {
-            total += records[i].pop_2014;
+/* Make every column the data left blank a numeric one */
+static int dataset_settle(Dataset *ds) {
+    for (int c=0; c<ds->num_columns; c++) {
+        if (ds->columns[c].type == COL_UNKNOWN && column_settle(&ds->columns[c], COL_FLOAT, ds->count, ds->capacity) < 0) {
+            return -1;
         }
     }
-    printf("2014 population: %lld\n", total);
+    return 0;
 }
 
-/* population:<field> - compute total sub-population */
-static void op_population_sub(CountyRecord *records, int count, const char *field) {
-    double total = 0.0;
-    for (int i=0; i<count; i++) {
-        if (!records[i].active) continue;
-        float val;
-        if (strcmp(field, "Education.Bachelor's Degree or Higher") == 0) val = records[i].edu_bachelors;
-        else if (strcmp(field, "Education.High School or Higher") == 0) val = records[i].edu_hs;
-        else if (strcmp(field, "Ethnicities.American Indian and Alaska Native Alone") == 0) val = records[i].eth_ai;
-        else if (strcmp(field, "Ethnicities.Asian Alone") == 0) val = records[i].eth_asian;
-        else if (strcmp(field, "Ethnicities.Black Alone") == 0) val = records[i].eth_black;
-        else if (strcmp(field, "Ethnicities.Hispanic or Latino") == 0) val = records[i].eth_hisp;
-        else if (strcmp(field, "Ethnicities.Native Hawaiian and Other Pacific Islander Alone") == 0) val = records[i].eth_nhpi;
-        else if (strcmp(field, "Ethnicities.Two or More Races") == 0) val = records[i].eth_2more;
-        else if (strcmp(field, "Ethnicities.White Alone") == 0) val = records[i].eth_white;
-        else if (strcmp(field, "Ethnicities.White Alone, not Hispanic or Latino") == 0) val = records[i].eth_white_non_hisp;
-        else if (strcmp(field, "Income.Persons Below Poverty Level") == 0) val = records[i].income_poverty;
-        else {
-            fprintf(stderr, "Warning: population:<field>: invalid field '%s'\n", field);
-            return;
+/* Store field in row r of a numeric column; -1 rejects the row (or is out of memory) */
+static int column_set_number(Column *col, int r, const char *field, int capacity) {
+    int ival = 0;
+    float fval = 0.0f;
+    ColumnType type = parse_number(field, &ival, &fval);
+    if (type == COL_STRING) {
+        if (col->required) return -1;
+        // Blanks and other text in optional columns are missing values
+        if (col->type == COL_INT && !col->pinned && column_promote_to_float(col, r, capacity) < 0) return -1;
+        if (col->type == COL_INT) {
+            col->i[r] = 0;
+        } else {
+            col->f[r] = NAN;
         }
-
-        double sub_pop = (double)records[i].pop_2014 * (val / 100.0);
-        total += sub_pop;
+        return 0;
     }
-    printf("2014 %s population: %f\n", field, total);
+    if (col->type == COL_INT && type == COL_FLOAT) {
+        if (col->pinned) {
+            // Pinned int columns keep the lenient integer prefix parse
+            if (convert_to_int(field, &ival) < 0) return -1;
+        } else if (column_promote_to_float(col, r, capacity) < 0) {
+            return -1;
+        }
+    }
+    if (col->type == COL_INT) {
+        col->i[r] = ival;
+    } else {
+        col->f[r] = fval;
+    }
+    return 0;
 }
 
-/* percent:<field> */
-static void op_percent_field(CountyRecord *records, int count, const char *field) {
-    long long total_pop = 0;
-    double sub_pop = 0.0;
-    for (int i=0; i<count; i++) {
-        if (!records[i].active) continue;
-        total_pop += records[i].pop_2014;
+/* Append one tokenized record as the next row of the dataset.
+ * field_to_column maps each header position to its column, -1 for ignored duplicates. */
+static int append_row(Dataset *ds, char **fields, int count, const int *field_to_column, int num_fields) {
+    if (count < num_fields) {
+        return -1;  // Missing fields
     }
 
-    if (total_pop == 0) {
-        printf("2014 %s percentage: 0\n", field);
-        return;
+    // Columns not pinned by name take the type of their first non-blank value
+    for (int k=0; k<num_fields; k++) {
+        int c = field_to_column[k];
+        if (c < 0 || ds->columns[c].type != COL_UNKNOWN) continue;
+        if (!fields[k][0] && ds->columns[c].required) return -1;
+        if (fields[k][0] && !ds->defer_types
+            && column_settle(&ds->columns[c], classify_value(fields[k]), ds->count, ds->capacity) < 0) {
+            return -1;
+        }
     }
 
-    for (int i=0; i<count; i++) {
-        if (!records[i].active) continue;
-        float val;
-        if (strcmp(field, "Education.Bachelor's Degree or Higher") == 0) val = records[i].edu_bachelors;
-        else if (strcmp(field, "Education.High School or Higher") == 0) val = records[i].edu_hs;
-        else if (strcmp(field, "Ethnicities.American Indian and Alaska Native Alone") == 0) val = records[i].eth_ai;
-        else if (strcmp(field, "Ethnicities.Asian Alone") == 0) val = records[i].eth_asian;
-        else if (strcmp(field, "Ethnicities.Black Alone") == 0) val = records[i].eth_black;
-        else if (strcmp(field, "Ethnicities.Hispanic or Latino") == 0) val = records[i].eth_hisp;
-        else if (strcmp(field, "Ethnicities.Native Hawaiian and Other Pacific Islander Alone") == 0) val = records[i].eth_nhpi;
-        else if (strcmp(field, "Ethnicities.Two or More Races") == 0) val = records[i].eth_2more;
-        else if (strcmp(field, "Ethnicities.White Alone") == 0) val = records[i].eth_white;
-        else if (strcmp(field, "Ethnicities.White Alone, not Hispanic or Latino") == 0) val = records[i].eth_white_non_hisp;
-        else if (strcmp(field, "Income.Persons Below Poverty Level") == 0) val = records[i].income_poverty;
-        else {
-            fprintf(stderr, "Warning: percent:<field>: invalid field '%s'\n", field);
-            return;
+    if (dataset_reserve(ds, ds->count+1) < 0) return -1;
+    int r = ds->count;
+
+    // Convert numbers into the next free slot; the row only becomes visible once count is bumped
+    for (int k=0; k<num_fields; k++) {
+        int c = field_to_column[k];
+        if (c < 0) continue;
+        Column *col = &ds->columns[c];
+        if (col->type != COL_INT && col->type != COL_FLOAT) continue;
+        if (column_set_number(col, r, fields[k], ds->capacity) < 0) return -1;
+    }
+
+    for (int k=0; k<num_fields; k++) {
+        int c = field_to_column[k];
+        if (c < 0) continue;
+        Column *col = &ds->columns[c];
+        if (col->type == COL_INTERNED) {
+            int id = dict_intern(&col->dict, fields[k]);
+            if (id < 0) return -1;
+            col->codes[r] = id;
+        } else if (col->type == COL_STRING || col->type == COL_UNKNOWN) {
+            col->s[r] = fields[k];
         }
-        sub_pop += (double)records[i].pop_2014 * (val / 100.0);
     }
 
-    double percentage = (sub_pop / (double)total_pop)*100.0;
-    printf("2014 %s percentage: %f\n", field, percentage);
+    ds->count++;
+    return 0;
 }
 
-static void process_operation_line(char *line, int line_num, CountyRecord *records, int count) {
-    char *p = line;
-    while (isspace((unsigned char)*p)) p++;
-    if (*p == '\0') {
-        return; // blank line
-    }
+/* Read the whole file into a writable buffer that ends with a newline, so the
+ * tokenizer can terminate fields in place. Regular files are mapped privately;
+ * anything else (or a file whose last page has no room for the newline) is read. */
+static char *load_input(const char *filename, size_t *len, int *mapped) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
 
-    char op_line[1024];
-    strcpy(op_line, p);
-    // Remove trailing whitespace
-    for (int i=(int)strlen(op_line)-1; i>=0 && isspace((unsigned char)op_line[i]); i--) {
-        op_line[i] = '\0';
+    struct stat st;
+    char last = '\n';
+    long page = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+        && pread(fd, &last, 1, st.st_size-1) == 1
+        && (last == '\n' || st.st_size % page != 0)) {
+        size_t size = (size_t)st.st_size;
+        // Bytes past EOF inside the last page are mapped as zeros and may be written
+        size_t map_len = (last == '\n') ? size : size+1;
+        char *buf = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            close(fd);
+            madvise(buf, map_len, MADV_SEQUENTIAL);
+            buf[map_len-1] = '\n';
+            *len = map_len;
+            *mapped = 1;
+            return buf;
+        }
     }
 
-    char *saveptr;
-    char *op = strtok_r(op_line, ":", &saveptr);
-    if (!op) {
-        fprintf(stderr, "Error: Malformed operation line %d\n", line_num);
-        return;
+    size_t capacity = 65536, size = 0;
+    char *buf = malloc(capacity);
+    ssize_t n;
+    while (buf) {
+        if (size+1 >= capacity) {
+            char *p = realloc(buf, capacity*2);
+            if (!p) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = p;
+            capacity *= 2;
+        }
+        n = read(fd, buf+size, capacity-size-1);
+        if (n <= 0) break;
+        size += (size_t)n;
     }
+    close(fd);
+    if (!buf) return NULL;
+    if (size > 0 && buf[size-1] != '\n') {
+        buf[size++] = '\n';
+    }
+    *len = size;
+    *mapped = 0;
+    return buf;
+}
 
-    if (strcmp(op, "display") == 0) {
-        op_display(records, count);
-    } else if (strcmp(op, "filter-state") == 0) {
-        char *state = strtok_r(NULL, ":", &saveptr);
-        if (!state) {
-            fprintf(stderr, "Error: Malformed operation line %d: filter-state requires a state code.\n", line_num);
-            return;
+static void free_dataset(Dataset *ds) {
+    for (int c=0; c<ds->num_columns; c++) {
+        Column *col = &ds->columns[c];
+        free(col->s);
+        if (!ds->borrowed_columns) {
+            free(col->codes);
+            free(col->i);
+            free(col->f);
         }
-        op_filter_state(records, count, state);
-    } else if (strcmp(op, "filter") == 0) {
-        char *field = strtok_r(NULL, ":", &saveptr);
-        char *cmp = strtok_r(NULL, ":", &saveptr);
-        char *num_str = strtok_r(NULL, ":", &saveptr);
-        if (!field || !cmp || !num_str) {
-            fprintf(stderr, "Error: Malformed operation line %d: filter requires field:op:number.\n", line_num);
-            return;
+        if (!ds->borrowed_indexes) {
+            free(col->order);
+            free(col->code_start);
         }
-        if (!is_numeric_field(field)) {
-            fprintf(stderr, "Error: filter field '%s' is not numeric.\n", field);
-            return;
+        dict_free(&col->dict);
+    }
+    free(ds->columns);
+    dict_free(&ds->column_names);
+    if (ds->buffer_mapped) {
+        munmap(ds->buffer, ds->buffer_len);
+    } else {
+        free(ds->buffer);
+    }
+    memset(ds, 0, sizeof(*ds));
+}
+
+/* Build the schema from the header fields; returns the header-position to column map */
+static int *build_schema(Dataset *ds, char **headers, int hcount) {
+    int *field_to_column = malloc(sizeof(int)*(hcount ? hcount : 1));
+    ds->columns = calloc(hcount ? hcount : 1, sizeof(Column));
+    if (!field_to_column || !ds->columns) {
+        free(field_to_column);
+        return NULL;
+    }
+
+    for (int k=0; k<hcount; k++) {
+        if (dict_find(&ds->column_names, headers[k]) >= 0) {
+            field_to_column[k] = -1;  // Duplicate header, first one wins
+            continue;
         }
-        float number;
-        if (convert_to_float(num_str, &number) < 0) {
-            fprintf(stderr, "Error: filter number '%s' invalid on line %d.\n", num_str, line_num);
-            return;
+        int c = dict_intern(&ds->column_names, headers[k]);
+        if (c < 0) {
+            free(field_to_column);
+            return NULL;
         }
-        if ((strcmp(cmp, "ge") != 0) && (strcmp(cmp, "le") != 0)) {
-            fprintf(stderr, "Error: filter comparison '%s' invalid on line %d.\n", cmp, line_num);
-            return;
+        field_to_column[k] = c;
+        ds->columns[c].name = ds->column_names.strings[c];
+        ds->num_columns++;
+    }
+
+    ds->col_county = find_column(ds, "County");
+    ds->col_state = find_column(ds, "State");
+    ds->col_pop = find_column(ds, "Population.2014 Population");
+
+    // Key columns keep fixed types so that lookups and population sums stay exact
+    if (ds->col_county >= 0) {
+        ds->columns[ds->col_county].type = COL_STRING;
+        ds->columns[ds->col_county].pinned = 1;
+    }
+    if (ds->col_state >= 0) {
+        ds->columns[ds->col_state].type = COL_INTERNED;
+        ds->columns[ds->col_state].pinned = 1;
+    }
+    if (ds->col_pop >= 0) {
+        ds->columns[ds->col_pop].type = COL_INT;
+        ds->columns[ds->col_pop].pinned = 1;
+    }
+    return field_to_column;
+}
+
+/* Give part an empty copy of the schema of ds, with its own dictionaries */
+static int dataset_init_part(Dataset *part, const Dataset *ds) {
+    memset(part, 0, sizeof(*part));
+    part->columns = calloc(ds->num_columns ? ds->num_columns : 1, sizeof(Column));
+    if (!part->columns) return -1;
+    part->num_columns = ds->num_columns;
+    for (int c=0; c<ds->num_columns; c++) {
+        part->columns[c].name = ds->columns[c].name;
+        part->columns[c].type = ds->columns[c].type;
+        part->columns[c].pinned = ds->columns[c].pinned;
+        part->columns[c].required = ds->columns[c].required;
+    }
+    part->col_county = ds->col_county;
+    part->col_state = ds->col_state;
+    part->col_pop = ds->col_pop;
+    part->defer_types = 1;
+    return 0;
+}
+
+/* Append the raw fields a deferred part column kept, n rows, to dst at row
+ * 'rows', typing dst by its first non-blank value as append_row would have */
+static int column_append_fields(Column *dst, int rows, int capacity, char *const *fields, int n) {
+    for (int r=0; r<n; r++) {
+        if (dst->type == COL_UNKNOWN && fields[r][0]
+            && column_settle(dst, classify_value(fields[r]), rows + r, capacity) < 0) {
+            return -1;
         }
-        op_filter_numeric(records, count, field, cmp, number);
-    } else if (strcmp(op, "population-total") == 0) {
-        op_population_total(records, count);
-    } else if (strcmp(op, "population") == 0) {
-        char *field = strtok_r(NULL, ":", &saveptr);
-        if (!field) {
-            fprintf(stderr, "Error: Malformed population operation at line %d.\n", line_num);
-            return;
+        if (dst->type == COL_STRING || dst->type == COL_UNKNOWN) {
+            dst->s[rows + r] = fields[r];
+        } else if (column_set_number(dst, rows + r, fields[r], capacity) < 0) {
+            return -1;
         }
-        if (!is_population_subfield(field)) {
-            fprintf(stderr, "Error: population field '%s' not supported.\n", field);
-            return;
+    }
+    return 0;
+}
+
+/* Move the rows of part onto the end of ds, widening columns, typing the
+ * ones that were blank and remapping interned ids so the result matches a
+ * serial parse */
+static int dataset_append_part(Dataset *ds, Dataset *part) {
+    if (dataset_reserve(ds, ds->count + part->count) < 0) return -1;
+    for (int c=0; c<ds->num_columns; c++) {
+        Column *dst = &ds->columns[c];
+        Column *src = &part->columns[c];
+        if (src->type == COL_UNKNOWN) {
+            // Blank when the parse started: the part kept its fields to be typed here, in row order
+            if (column_append_fields(dst, ds->count, ds->capacity, src->s, part->count) < 0) return -1;
+            continue;
         }
-        op_population_sub(records, count, field);
-    } else if (strcmp(op, "percent") == 0) {
-        char *field = strtok_r(NULL, ":", &saveptr);
-        if (!field) {
-            fprintf(stderr, "Error: Malformed percent operation at line %d.\n", line_num);
-            return;
+        if (dst->type == COL_INT && src->type == COL_FLOAT) {
+            if (column_promote_to_float(dst, ds->count, ds->capacity) < 0) return -1;
+        } else if (dst->type == COL_FLOAT && src->type == COL_INT) {
+            if (column_promote_to_float(src, part->count, part->count) < 0) return -1;
         }
-        if (!is_population_subfield(field)) {
-            fprintf(stderr, "Error: percent field '%s' not supported.\n", field);
-            return;
+
+        switch (dst->type) {
+        case COL_STRING:
+            memcpy(dst->s + ds->count, src->s, sizeof(char*)*part->count);
+            break;
+        case COL_INTERNED: {
+            int *remap = malloc(sizeof(int)*(src->dict.count ? src->dict.count : 1));
+            if (!remap) return -1;
+            for (int j=0; j<src->dict.count; j++) {
+                remap[j] = dict_intern(&dst->dict, src->dict.strings[j]);
+                if (remap[j] < 0) {
+                    free(remap);
+                    return -1;
+                }
+            }
+            for (int r=0; r<part->count; r++) {
+                dst->codes[ds->count + r] = remap[src->codes[r]];
+            }
+            free(remap);
+            break;
+        }
+        case COL_INT:
+            memcpy(dst->i + ds->count, src->i, sizeof(int)*part->count);
+            break;
+        case COL_FLOAT:
+            memcpy(dst->f + ds->count, src->f, sizeof(float)*part->count);
+            break;
+        case COL_UNKNOWN:
+            break;
         }
-        op_percent_field(records, count, field);
-    } else {
-        fprintf(stderr, "Error: Unrecognized operation '%s' on line %d.\n", op, line_num);
     }
+    ds->count += part->count;
+    return 0;
 }
 
-static void process_operations(const char *filename, CountyRecord *records, int count) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open operations file '%s'\n", filename);
-        return;
+/* Thread body: tokenize and append every record of one slice */
+static void *parse_chunk(void *arg) {
+    ParseChunk *chunk = arg;
+    char **fields = malloc(sizeof(char*)*chunk->num_fields);
+    if (!fields) {
+        chunk->error = 1;
+        return NULL;
     }
 
-    char line[1024];
-    int line_num = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        line_num++;
-        process_operation_line(line, line_num, records, count);
+    char *pos = chunk->start;
+    while (pos < chunk->end) {
+        int count = tokenize_record(&pos, fields, chunk->num_fields);
+        if (count < 0 || append_row(chunk->part, fields, count, chunk->field_to_column, chunk->num_fields) != 0) {
+            if (chunk->num_bad >= chunk->bad_capacity) {
+                int capacity = chunk->bad_capacity ? chunk->bad_capacity*2 : 16;
+                int *p = realloc(chunk->bad_lines, sizeof(int)*capacity);
+                if (!p) {
+                    chunk->error = 1;
+                    break;
+                }
+                chunk->bad_lines = p;
+                chunk->bad_capacity = capacity;
+            }
+            chunk->bad_lines[chunk->num_bad++] = chunk->num_lines;
+        }
+        chunk->num_lines++;
     }
-
-    fclose(fp);
+    free(fields);
+    return NULL;
 }
 
-static void free_records(CountyRecord *records, int count) {
-    for (int i=0; i<count; i++) {
-        free(records[i].county);
-        free(records[i].state);
-    }
-    free(records);
+/* Worker threads for loading, aggregates and multi-file runs */
+static int thread_count(void) {
+    if (thread_limit > 0) return thread_limit;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > MAX_THREADS ? MAX_THREADS : (int)n;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Call with 2 arguments: <demographics_file> <operations_file>\n");
-        return 1;
-    }
+/* Parse the records in [pos, end) on up to num_threads threads. Chunk 0 appends
+ * straight into ds; the others fill private parts that are merged in order.
+ * Malformed lines are reported afterwards in file order, numbered from line_num. */
+static int parse_records_parallel(Dataset *ds, char *pos, char *end, const int *field_to_column,
+                                  int num_fields, int line_num, int num_threads, const char *kind) {
+    size_t bytes = (size_t)(end - pos);
+    int n = (int)(bytes / MIN_CHUNK_BYTES);
+    if (n > num_threads) n = num_threads;
+    if (n < 1) n = 1;
 
-    const char *dem_file = argv[1];
-    const char *ops_file = argv[2];
+    ParseChunk chunks[MAX_THREADS];
+    Dataset parts[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    memset(started, 0, sizeof(started));
 
-    FILE *fp = fopen(dem_file, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open demographics file '%s'\n", dem_file);
-        return 1;
+    // Cut at the first newline after each nominal boundary; quoted fields never span lines
+    char *cut = pos;
+    for (int k=0; k<n; k++) {
+        chunks[k].start = cut;
+        if (k == n-1) {
+            cut = end;
+        } else {
+            char *target = pos + bytes/n*(k+1);
+            if (target < cut) target = cut;
+            char *nl = memchr(target, '\n', (size_t)(end - target));
+            cut = nl ? nl+1 : end;
+        }
+        chunks[k].end = cut;
+        chunks[k].field_to_column = field_to_column;
+        chunks[k].num_fields = num_fields;
     }
-    fclose(fp);
 
-    fp = fopen(ops_file, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open operations file '%s'\n", ops_file);
-        return 1;
-    }
-    fclose(fp);
+    int error = 0;
+    chunks[0].part = ds;
+    for (int k=1; k<n; k++) {
+        chunks[k].part = &parts[k];
+        if (dataset_init_part(&parts[k], ds) < 0) {
+            error = 1;
+            continue;
+        }
+        if (pthread_create(&threads[k], NULL, parse_chunk, &chunks[k]) == 0) {
+            started[k] = 1;
+        } else {
+            parse_chunk(&chunks[k]);
+        }
+    }
+    parse_chunk(&chunks[0]);
+    for (int k=1; k<n; k++) {
+        if (started[k]) pthread_join(threads[k], NULL);
+    }
+
+    for (int k=0; k<n; k++) {
+        for (int b=0; b<chunks[k].num_bad; b++) {
+            fprintf(stderr, "Error: Malformed line %d in %s file. Skipping.\n",
+                    line_num + chunks[k].bad_lines[b] + 1, kind);
+        }
+        line_num += chunks[k].num_lines;
+        error |= chunks[k].error;
+        if (k > 0) {
+            if (!error && dataset_append_part(ds, &parts[k]) < 0) error = 1;
+            free_dataset(&parts[k]);
+        }
+        free(chunks[k].bad_lines);
+    }
+    return error ? -1 : 0;
+}
+
+/* Parse a CSV with a header into ds; 'kind' names the file in messages
+ * and the header must hold every one of the required columns */
+static int load_csv(const char *filename, const char *kind, const char *const *required, int num_required,
+                    Dataset *ds) {
+    memset(ds, 0, sizeof(*ds));
+    ds->buffer = load_input(filename, &ds->buffer_len, &ds->buffer_mapped);
+    if (!ds->buffer) {
+        fprintf(stderr, "Error: Cannot open %s file '%s'\n", kind, filename);
+        return -1;
+    }
+    if (ds->buffer_len == 0) {
+        fprintf(stderr, "Error: %c%s file is empty.\n", toupper((unsigned char)kind[0]), kind+1);
+        free_dataset(ds);
+        return -1;
+    }
+
+    char *pos = ds->buffer;
+    char *end = ds->buffer + ds->buffer_len;
+
+    // Parse header
+    char *headers[200];
+    int hcount = tokenize_record(&pos, headers, 200);
+    if (hcount > 200) hcount = 200;
+    int *field_to_column = hcount > 0 ? build_schema(ds, headers, hcount) : NULL;
+    if (!field_to_column) {
+        fprintf(stderr, "Error: Cannot parse %s header.\n", kind);
+        free_dataset(ds);
+        return -1;
+    }
+
+    // Check if any required field is missing
+    for (int i=0; i<num_required; i++) {
+        int c = find_column(ds, required[i]);
+        if (c < 0) {
+            fprintf(stderr, "Error: Missing required column in %s file.\n", kind);
+            free(field_to_column);
+            free_dataset(ds);
+            return -1;
+        }
+        ds->columns[c].required = 1;
+    }
+
+    char **fields = malloc(sizeof(char*)*hcount);
+    if (!fields) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(field_to_column);
+        free_dataset(ds);
+        return -1;
+    }
+    // Parse serially until the first good row has settled the column types it can;
+    // columns still blank are typed as the parallel parts are merged
+    int line_num = 1; // header is line 1
+    while (pos < end && ds->count == 0) {
+        line_num++;
+        int count = tokenize_record(&pos, fields, hcount);
+        if (count < 0 || append_row(ds, fields, count, field_to_column, hcount) != 0) {
+            fprintf(stderr, "Error: Malformed line %d in %s file. Skipping.\n", line_num, kind);
+        }
+    }
+    free(fields);
+
+    int status = 0;
+    if (pos < end) {
+        status = parse_records_parallel(ds, pos, end, field_to_column, hcount, line_num, thread_count(), kind);
+    }
+    if (status == 0) status = dataset_settle(ds);
+    free(field_to_column);
+    if (status < 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free_dataset(ds);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_demographics(const char *filename, Dataset *ds) {
+    int num_required = (int)(sizeof(required_columns)/sizeof(required_columns[0]));
+    if (load_csv(filename, "demographics", required_columns, num_required, ds) < 0) return -1;
+    if (!quiet_load) fprintf(LOAD_LOG, "%d records loaded\n", ds->count);
+    return 0;
+}
+
+/* Radix sort key that orders floats numerically, with -0 alongside +0 */
+static inline uint32_t float_sort_key(float v) {
+    if (v == 0.0f) v = 0.0f;
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits >> 31) ? ~bits : bits | 0x80000000u;
+}
+
+/* Secondary index of one column. Numeric columns get their row ids sorted by
+ * value and interned columns get them grouped by code, both keeping row
+ * order among equal keys. Counting and byte-wise radix passes keep this
+ * O(n) per column. */
+static int build_column_index(Column *c, int n) {
+    int *order = malloc(sizeof(int)*(n ? n : 1));
+    if (!order) return -1;
+
+    if (c->type == COL_INTERNED) {
+        int num_codes = c->dict.count;
+        int *start = calloc(num_codes+1, sizeof(int));
+        int *next = malloc(sizeof(int)*(num_codes ? num_codes : 1));
+        if (!start || !next) {
+            free(order);
+            free(start);
+            free(next);
+            return -1;
+        }
+        for (int r=0; r<n; r++) start[c->codes[r]+1]++;
+        for (int k=0; k<num_codes; k++) start[k+1] += start[k];
+        memcpy(next, start, sizeof(int)*num_codes);
+        for (int r=0; r<n; r++) order[next[c->codes[r]]++] = r;
+        free(next);
+        c->order = order;
+        c->code_start = start;
+        return 0;
+    }
+
+    uint32_t *keys = malloc(sizeof(uint32_t)*(n ? n : 1));
+    uint32_t *keys_tmp = malloc(sizeof(uint32_t)*(n ? n : 1));
+    int *order_tmp = malloc(sizeof(int)*(n ? n : 1));
+    if (!keys || !keys_tmp || !order_tmp) {
+        free(order);
+        free(keys);
+        free(keys_tmp);
+        free(order_tmp);
+        return -1;
+    }
+    for (int r=0; r<n; r++) {
+        keys[r] = float_sort_key(c->type == COL_INT ? (float)c->i[r] : c->f[r]);
+        order[r] = r;
+    }
+    for (int shift=0; shift<32; shift+=8) {
+        int count[257] = {0};
+        for (int r=0; r<n; r++) count[((keys[r] >> shift) & 0xff) + 1]++;
+        if (count[((keys[0] >> shift) & 0xff) + 1] == n) continue;   // byte is the same everywhere
+        for (int b=0; b<256; b++) count[b+1] += count[b];
+        for (int r=0; r<n; r++) {
+            int at = count[(keys[r] >> shift) & 0xff]++;
+            keys_tmp[at] = keys[r];
+            order_tmp[at] = order[r];
+        }
+        uint32_t *k = keys; keys = keys_tmp; keys_tmp = k;
+        int *o = order; order = order_tmp; order_tmp = o;
+    }
+    free(keys);
+    free(keys_tmp);
+    free(order_tmp);
+    c->order = order;
+    return 0;
+}
+
+/* --index: build a secondary index for every numeric and interned column
+ * that does not already have one from a snapshot */
+static int build_indexes(Dataset *ds) {
+    if (ds->borrowed_indexes) return 0;
+    for (int c=0; c<ds->num_columns; c++) {
+        Column *col = &ds->columns[c];
+        if (col->order || (col->type != COL_INTERNED && !is_numeric_column(col))) continue;
+        if (build_column_index(col, ds->count) < 0) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Fold 8-byte words into a 64-bit FNV-style checksum; a short final word is zero-padded */
+static uint64_t checksum_update(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ull;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    if (len) {
+        uint64_t w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ w) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* Write one section padded with zeros to the next 8-byte boundary; returns its offset */
+static uint64_t snapshot_section(SnapshotWriter *w, const void *data, size_t len) {
+    static const char zeros[8];
+    uint64_t at = w->offset;
+    size_t pad = (8 - len % 8) % 8;
+    if (len && fwrite(data, 1, len, w->fp) != len) return 0;
+    if (pad && fwrite(zeros, 1, pad, w->fp) != pad) return 0;
+    w->hash = checksum_update(w->hash, data, len);
+    w->offset += len + pad;
+    return at;
+}
+
+/* Write n strings as an offset table followed by their bytes */
+static int snapshot_strings(SnapshotWriter *w, char *const *strings, int n, uint64_t *table, uint64_t *bytes) {
+    uint64_t *offsets = malloc(sizeof(uint64_t)*((size_t)n+1));
+    if (!offsets) return -1;
+    offsets[0] = 0;
+    for (int r=0; r<n; r++) {
+        offsets[r+1] = offsets[r] + strlen(strings[r]) + 1;
+    }
+    char *blob = malloc(offsets[n] ? offsets[n] : 1);
+    if (!blob) {
+        free(offsets);
+        return -1;
+    }
+    for (int r=0; r<n; r++) {
+        memcpy(blob + offsets[r], strings[r], offsets[r+1] - offsets[r]);
+    }
+    *table = snapshot_section(w, offsets, sizeof(uint64_t)*((size_t)n+1));
+    *bytes = snapshot_section(w, blob, offsets[n]);
+    free(blob);
+    free(offsets);
+    return (*table && *bytes) ? 0 : -1;
+}
+
+/* --snapshot: write the loaded dataset, built from source and the join
+ * specs, as a binary columnar file */
+static int write_snapshot(const Dataset *ds, const char *source, const char *const *joins, int num_joins,
+                          const char *filename) {
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.endian = SNAPSHOT_ENDIAN;
+    hdr.num_rows = ds->count;
+    hdr.num_columns = ds->num_columns;
+    hdr.num_joins = num_joins;
+    for (int c=0; c<ds->num_columns; c++) {
+        if (ds->columns[c].order) hdr.indexed = 1;
+    }
+
+    struct stat st;
+    if (stat(source, &st) == 0) {
+        hdr.source_size = (uint64_t)st.st_size;
+        hdr.source_mtime_sec = st.st_mtim.tv_sec;
+        hdr.source_mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    char *path = realpath(source, NULL);
+
+    SnapshotColumn *dir = calloc(ds->num_columns ? ds->num_columns : 1, sizeof(SnapshotColumn));
+    SnapshotJoin *join_dir = calloc(num_joins ? num_joins : 1, sizeof(SnapshotJoin));
+    SnapshotWriter w = {fopen(filename, "wb"), sizeof(hdr), 14695981039346656037ull};
+    int ok = dir && join_dir && w.fp && fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1;
+
+    const char *src = path ? path : source;
+    ok = ok && (hdr.source_path = snapshot_section(&w, src, strlen(src)+1)) != 0;
+    for (int j=0; ok && j<num_joins; j++) {
+        // The spec is file[:keys], as join_dataset splits it
+        char file[1024], spec[2048];
+        snprintf(file, sizeof(file), "%s", joins[j]);
+        char *colon = strrchr(file, ':');
+        if (colon) *colon = '\0';
+        if (stat(file, &st) == 0) {
+            join_dir[j].size = (uint64_t)st.st_size;
+            join_dir[j].mtime_sec = st.st_mtim.tv_sec;
+            join_dir[j].mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        char *join_path = realpath(file, NULL);
+        snprintf(spec, sizeof(spec), "%s%s%s", join_path ? join_path : file, colon ? ":" : "", colon ? colon+1 : "");
+        free(join_path);
+        ok = (join_dir[j].spec = snapshot_section(&w, spec, strlen(spec)+1)) != 0;
+    }
+    for (int c=0; ok && c<ds->num_columns; c++) {
+        const Column *col = &ds->columns[c];
+        SnapshotColumn *e = &dir[c];
+        e->type = col->type;
+        e->pinned = (uint32_t)col->pinned;
+        ok = (e->name = snapshot_section(&w, col->name, strlen(col->name)+1)) != 0;
+        switch (col->type) {
+        case COL_STRING:
+            ok = ok && snapshot_strings(&w, col->s, ds->count, &e->data, &e->strings) == 0;
+            break;
+        case COL_INTERNED:
+            e->dict_count = col->dict.count;
+            ok = ok && snapshot_strings(&w, col->dict.strings, col->dict.count, &e->dict, &e->strings) == 0;
+            ok = ok && (e->data = snapshot_section(&w, col->codes, sizeof(int)*ds->count)) != 0;
+            break;
+        case COL_INT:
+            ok = ok && (e->data = snapshot_section(&w, col->i, sizeof(int)*ds->count)) != 0;
+            break;
+        case COL_FLOAT:
+            ok = ok && (e->data = snapshot_section(&w, col->f, sizeof(float)*ds->count)) != 0;
+            break;
+        case COL_UNKNOWN:
+            break;
+        }
+        if (ok && col->order) {
+            ok = (e->index = snapshot_section(&w, col->order, sizeof(int)*ds->count)) != 0;
+        }
+        if (ok && col->code_start) {
+            ok = (e->index_starts = snapshot_section(&w, col->code_start, sizeof(int)*(col->dict.count+1))) != 0;
+        }
+    }
+    ok = ok && (hdr.directory = snapshot_section(&w, dir, sizeof(SnapshotColumn)*ds->num_columns)) != 0;
+    ok = ok && (!num_joins || (hdr.joins = snapshot_section(&w, join_dir, sizeof(SnapshotJoin)*num_joins)) != 0);
+
+    hdr.file_size = w.offset;
+    hdr.checksum = w.hash;
+    ok = ok && fseek(w.fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1;
+    if (w.fp && fclose(w.fp) != 0) ok = 0;
+    free(dir);
+    free(join_dir);
+    free(path);
+
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot write snapshot '%s'\n", filename);
+        unlink(filename);
+        return -1;
+    }
+    fprintf(LOAD_LOG, "Snapshot written to %s\n", filename);
+    return 0;
+}
+
+static int snapshot_range_ok(const SnapshotHeader *hdr, uint64_t offset, uint64_t len) {
+    return offset >= sizeof(*hdr) && offset <= hdr->file_size && len <= hdr->file_size - offset;
+}
+
+/* Point a string column at n strings stored by snapshot_strings */
+static char **snapshot_string_views(char *base, const SnapshotHeader *hdr, uint64_t table, uint64_t bytes, int n) {
+    if (!snapshot_range_ok(hdr, table, sizeof(uint64_t)*((uint64_t)n+1))) return NULL;
+    const uint64_t *offsets = (const uint64_t *)(base + table);
+    if (!snapshot_range_ok(hdr, bytes, offsets[n])) return NULL;
+    char **views = malloc(sizeof(char*)*(n ? n : 1));
+    if (!views) return NULL;
+    for (int r=0; r<n; r++) {
+        if (offsets[r+1] <= offsets[r] || offsets[r+1] > offsets[n] || base[bytes + offsets[r+1] - 1] != '\0') {
+            free(views);
+            return NULL;
+        }
+        views[r] = base + bytes + offsets[r];
+    }
+    return views;
+}
+
+/* Has the file changed since the snapshot recorded its size and mtime? A
+ * missing file is not checked */
+static int file_changed(const char *path, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec) {
+    struct stat st;
+    return stat(path, &st) == 0
+           && ((uint64_t)st.st_size != size || st.st_mtim.tv_sec != mtime_sec || st.st_mtim.tv_nsec != mtime_nsec);
+}
+
+static void free_snapshot_origin(SnapshotOrigin *origin) {
+    for (int j=0; origin->joins && j<origin->num_joins; j++) {
+        free(origin->joins[j]);
+    }
+    free(origin->joins);
+    free(origin->source);
+}
+
+/* Map a snapshot written by write_snapshot. Returns 1 when the snapshot is
+ * stale against its source CSV or a join file (ds is left empty and origin
+ * says how to rebuild it), 0 on success, -1 on error. */
+static int load_snapshot(const char *filename, Dataset *ds, SnapshotOrigin *origin) {
+    memset(ds, 0, sizeof(*ds));
+    memset(origin, 0, sizeof(*origin));
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "Error: Cannot read snapshot '%s'\n", filename);
+        return -1;
+    }
+    char *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot read snapshot '%s'\n", filename);
+        return -1;
+    }
+    ds->buffer = base;
+    ds->buffer_len = (size_t)st.st_size;
+    ds->buffer_mapped = 1;
+    ds->borrowed_columns = 1;
+
+    const SnapshotHeader *hdr = (const SnapshotHeader *)base;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) != 0 || hdr->version != SNAPSHOT_VERSION
+        || hdr->endian != SNAPSHOT_ENDIAN || hdr->file_size != (uint64_t)st.st_size
+        || hdr->num_rows < 0 || hdr->num_columns <= 0
+        || checksum_update(14695981039346656037ull, base + sizeof(*hdr), hdr->file_size - sizeof(*hdr)) != hdr->checksum
+        || !snapshot_range_ok(hdr, hdr->source_path, 1)
+        || memchr(base + hdr->source_path, '\0', hdr->file_size - hdr->source_path) == NULL
+        || !snapshot_range_ok(hdr, hdr->directory, sizeof(SnapshotColumn)*(uint64_t)hdr->num_columns)
+        || hdr->num_joins < 0
+        || (hdr->num_joins && !snapshot_range_ok(hdr, hdr->joins, sizeof(SnapshotJoin)*(uint64_t)hdr->num_joins))) {
+        fprintf(stderr, "Error: Snapshot '%s' is corrupt or from an incompatible version.\n", filename);
+        free_dataset(ds);
+        return -1;
+    }
+    const SnapshotJoin *joins = (const SnapshotJoin *)(base + hdr->joins);
+    for (int j=0; j<hdr->num_joins; j++) {
+        if (!snapshot_range_ok(hdr, joins[j].spec, 1)
+            || memchr(base + joins[j].spec, '\0', hdr->file_size - joins[j].spec) == NULL) {
+            fprintf(stderr, "Error: Snapshot '%s' is corrupt or from an incompatible version.\n", filename);
+            free_dataset(ds);
+            return -1;
+        }
+    }
+
+    // A snapshot is stale once its source CSV or a join file has changed
+    const char *src = base + hdr->source_path;
+    int stale = file_changed(src, hdr->source_size, hdr->source_mtime_sec, hdr->source_mtime_nsec);
+    for (int j=0; !stale && j<hdr->num_joins; j++) {
+        char file[1024];
+        snprintf(file, sizeof(file), "%s", base + joins[j].spec);
+        char *colon = strrchr(file, ':');
+        if (colon) *colon = '\0';
+        stale = file_changed(file, joins[j].size, joins[j].mtime_sec, joins[j].mtime_nsec);
+    }
+    if (stale) {
+        origin->source = strdup(src);
+        origin->joins = calloc(hdr->num_joins ? hdr->num_joins : 1, sizeof(char*));
+        origin->indexed = hdr->indexed;
+        int ok = origin->source && origin->joins;
+        for (int j=0; ok && j<hdr->num_joins; j++) {
+            ok = (origin->joins[j] = strdup(base + joins[j].spec)) != NULL;
+            origin->num_joins++;
+        }
+        free_dataset(ds);
+        if (!ok) {
+            free_snapshot_origin(origin);
+            fprintf(stderr, "Error: Out of memory.\n");
+            return -1;
+        }
+        return 1;
+    }
+
+    int n = hdr->num_rows;
+    const SnapshotColumn *dir = (const SnapshotColumn *)(base + hdr->directory);
+    ds->columns = calloc(hdr->num_columns, sizeof(Column));
+    int ok = ds->columns != NULL;
+    for (int c=0; ok && c<hdr->num_columns; c++) {
+        const SnapshotColumn *e = &dir[c];
+        Column *col = &ds->columns[c];
+        ok = snapshot_range_ok(hdr, e->name, 1) && memchr(base + e->name, '\0', hdr->file_size - e->name)
+             && dict_intern(&ds->column_names, base + e->name) == c;
+        if (!ok) break;
+        ds->num_columns++;
+        col->name = ds->column_names.strings[c];
+        col->type = (ColumnType)e->type;
+        col->pinned = (int)e->pinned;
+        switch (col->type) {
+        case COL_STRING:
+            ok = (col->s = snapshot_string_views(base, hdr, e->data, e->strings, n)) != NULL;
+            break;
+        case COL_INTERNED: {
+            char **dict = e->dict_count >= 0 ? snapshot_string_views(base, hdr, e->dict, e->strings, e->dict_count) : NULL;
+            ok = dict && snapshot_range_ok(hdr, e->data, sizeof(int)*(uint64_t)n);
+            for (int j=0; ok && j<e->dict_count; j++) {
+                ok = dict_intern(&col->dict, dict[j]) == j;
+            }
+            free(dict);
+            col->codes = (int *)(base + e->data);
+            for (int r=0; ok && r<n; r++) {
+                ok = col->codes[r] >= 0 && col->codes[r] < e->dict_count;
+            }
+            break;
+        }
+        case COL_INT:
+            ok = snapshot_range_ok(hdr, e->data, sizeof(int)*(uint64_t)n);
+            col->i = (int *)(base + e->data);
+            break;
+        case COL_FLOAT:
+            ok = snapshot_range_ok(hdr, e->data, sizeof(float)*(uint64_t)n);
+            col->f = (float *)(base + e->data);
+            break;
+        default:
+            ok = 0;
+            break;
+        }
+        if (ok && e->index) {
+            ok = snapshot_range_ok(hdr, e->index, sizeof(int)*(uint64_t)n);
+            col->order = (int *)(base + e->index);
+            for (int r=0; ok && r<n; r++) {
+                ok = col->order[r] >= 0 && col->order[r] < n;
+            }
+            ds->borrowed_indexes = 1;
+        }
+        if (ok && col->type == COL_INTERNED && e->index) {
+            ok = snapshot_range_ok(hdr, e->index_starts, sizeof(int)*((uint64_t)e->dict_count+1));
+            col->code_start = (int *)(base + e->index_starts);
+            for (int k=0; ok && k<e->dict_count; k++) {
+                ok = col->code_start[k] >= 0 && col->code_start[k] <= col->code_start[k+1] && col->code_start[k+1] <= n;
+            }
+        }
+    }
+    ds->count = ds->capacity = n;
+    if (ok) {
+        ds->col_county = find_column(ds, "County");
+        ds->col_state = find_column(ds, "State");
+        ds->col_pop = find_column(ds, "Population.2014 Population");
+        for (size_t i=0; ok && i<sizeof(required_columns)/sizeof(required_columns[0]); i++) {
+            ok = find_column(ds, required_columns[i]) >= 0;
+        }
+        ok = ok && ds->columns[ds->col_county].type == COL_STRING
+             && ds->columns[ds->col_state].type == COL_INTERNED
+             && ds->columns[ds->col_pop].type == COL_INT;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Snapshot '%s' is corrupt or from an incompatible version.\n", filename);
+        free_dataset(ds);
+        return -1;
+    }
+
+    if (!quiet_load) fprintf(LOAD_LOG, "%d records loaded\n", ds->count);
+    return 0;
+}
+
+/* Most key columns a --join can match on */
+#define MAX_JOIN_KEYS 8
+
+/* Most --join files one run can attach */
+#define MAX_JOIN_FILES 8
+
+/* Key of row r: the values of the key columns separated by \x1f */
+static void join_key(const Dataset *ds, const int *cols, int num_keys, int r, char *buf, size_t len) {
+    size_t at = 0;
+    buf[0] = '\0';
+    for (int k=0; k<num_keys && at < len; k++) {
+        const Column *c = &ds->columns[cols[k]];
+        const char *sep = k ? "\x1f" : "";
+        int n = 0;
+        switch (c->type) {
+        case COL_STRING:
+            n = snprintf(buf+at, len-at, "%s%s", sep, c->s[r]);
+            break;
+        case COL_INTERNED:
+            n = snprintf(buf+at, len-at, "%s%s", sep, c->dict.strings[c->codes[r]]);
+            break;
+        case COL_INT:
+            n = snprintf(buf+at, len-at, "%s%d", sep, c->i[r]);
+            break;
+        case COL_FLOAT:
+            n = snprintf(buf+at, len-at, "%s%.9g", sep, c->f[r]);
+            break;
+        case COL_UNKNOWN:
+            break;
+        }
+        if (n < 0) break;
+        at += (size_t)n;
+    }
+}
+
+/* Set match[r] to the first row of jd whose key equals that of row r of ds,
+ * or -1. The side with fewer rows is hashed and the other probes it once.
+ * Returns how many rows of jd repeat an earlier key, or -1 without memory. */
+static int join_rows(const Dataset *ds, const int *ds_keys, const Dataset *jd, const int *jd_keys, int num_keys,
+                     int *match) {
+    int build_jd = jd->count <= ds->count;
+    const Dataset *build = build_jd ? jd : ds;
+    const Dataset *probe = build_jd ? ds : jd;
+    const int *build_keys = build_jd ? jd_keys : ds_keys;
+    const int *probe_keys = build_jd ? ds_keys : jd_keys;
+
+    // Rows with equal keys are chained through next, in row order
+    StringDict table;
+    memset(&table, 0, sizeof(table));
+    int *head = malloc(sizeof(int)*(build->count ? build->count : 1));
+    int *next = malloc(sizeof(int)*(build->count ? build->count : 1));
+    int duplicates = head && next ? 0 : -1;
+    char key[1024];
+    for (int r=build->count-1; r>=0 && duplicates >= 0; r--) {
+        join_key(build, build_keys, num_keys, r, key, sizeof(key));
+        int known = table.count;
+        int id = dict_intern(&table, key);
+        if (id < 0) {
+            duplicates = -1;
+            break;
+        }
+        next[r] = id < known ? head[id] : -1;
+        head[id] = r;
+        if (build_jd && id < known) duplicates++;
+    }
+
+    for (int r=0; r<ds->count; r++) match[r] = -1;
+    for (int p=0; p<probe->count && duplicates >= 0; p++) {
+        join_key(probe, probe_keys, num_keys, p, key, sizeof(key));
+        int id = dict_find(&table, key);
+        if (id < 0) continue;
+        if (build_jd) {
+            match[p] = head[id];
+            continue;
+        }
+        int repeated = 0;
+        for (int r=head[id]; r>=0; r=next[r]) {
+            if (match[r] >= 0) {
+                repeated = 1;
+            } else {
+                match[r] = p;
+            }
+        }
+        duplicates += repeated;
+    }
+    free(head);
+    free(next);
+    dict_free(&table);
+    return duplicates;
+}
+
+/* Add column c of jd to ds, giving row r the value of row match[r] of jd.
+ * Text becomes an interned column; unmatched rows get 0 or "". */
+static int append_joined_column(Dataset *ds, const Dataset *jd, int c, const int *match) {
+    const Column *src = &jd->columns[c];
+    Column *p = realloc(ds->columns, sizeof(Column)*(ds->num_columns+1));
+    if (!p) return -1;
+    ds->columns = p;
+    int id = dict_intern(&ds->column_names, src->name);
+    if (id < 0) return -1;
+
+    Column *col = &ds->columns[id];
+    memset(col, 0, sizeof(*col));
+    col->name = ds->column_names.strings[id];
+    col->pinned = src->pinned;
+    // Rows without a match are missing values: NaN, so int columns become floats, or empty text
+    int unmatched = 0;
+    for (int r=0; r<ds->count; r++) {
+        unmatched |= match[r] < 0;
+    }
+    col->type = src->type == COL_STRING ? COL_INTERNED : src->type == COL_INT && unmatched ? COL_FLOAT : src->type;
+    ds->num_columns++;
+    if (column_reserve(col, ds->capacity > 0 ? ds->capacity : 1) < 0) return -1;
+
+    for (int r=0; r<ds->count; r++) {
+        int m = match[r];
+        switch (col->type) {
+        case COL_INT:
+            col->i[r] = src->i[m];
+            break;
+        case COL_FLOAT:
+            col->f[r] = m < 0 ? NAN : src->type == COL_INT ? (float)src->i[m] : src->f[m];
+            break;
+        default: {
+            const char *text = m < 0 ? "" : src->type == COL_STRING ? src->s[m] : src->dict.strings[src->codes[m]];
+            if ((col->codes[r] = dict_intern(&col->dict, text)) < 0) return -1;
+            break;
+        }
+        }
+    }
+    return 0;
+}
+
+/* --join <file>[:<key>,<key>...]: left join of another CSV onto ds on the
+ * key columns, County,State by default. Every other column of the file is
+ * added to ds, so filters and aggregates can use it like any other. */
+static int join_dataset(Dataset *ds, const char *spec) {
+    char file[1024];
+    snprintf(file, sizeof(file), "%s", spec);
+    const char *keys[MAX_JOIN_KEYS] = {"County", "State"};
+    int num_keys = 2;
+    char *colon = strrchr(file, ':');
+    if (colon) {
+        *colon = '\0';
+        num_keys = 0;
+        char *save;
+        for (char *k = strtok_r(colon+1, ",", &save); k; k = strtok_r(NULL, ",", &save)) {
+            if (num_keys == MAX_JOIN_KEYS) {
+                fprintf(stderr, "Error: --join takes at most %d key columns.\n", MAX_JOIN_KEYS);
+                return -1;
+            }
+            keys[num_keys++] = k;
+        }
+        if (num_keys == 0) {
+            fprintf(stderr, "Error: --join needs key columns after ':'.\n");
+            return -1;
+        }
+    }
+
+    int ds_keys[MAX_JOIN_KEYS], jd_keys[MAX_JOIN_KEYS];
+    for (int k=0; k<num_keys; k++) {
+        if ((ds_keys[k] = find_column(ds, keys[k])) < 0) {
+            fprintf(stderr, "Error: Join key '%s' is not a demographics column.\n", keys[k]);
+            return -1;
+        }
+    }
+    Dataset jd;
+    if (load_csv(file, "join", keys, num_keys, &jd) < 0) return -1;
+    for (int k=0; k<num_keys; k++) {
+        jd_keys[k] = find_column(&jd, keys[k]);
+    }
+
+    int *match = malloc(sizeof(int)*(ds->count ? ds->count : 1));
+    int duplicates = match ? join_rows(ds, ds_keys, &jd, jd_keys, num_keys, match) : -1;
+    int status = duplicates < 0 ? -1 : 0;
+    for (int c=0; c<jd.num_columns && status == 0; c++) {
+        int is_key = 0;
+        for (int k=0; k<num_keys; k++) is_key |= jd_keys[k] == c;
+        if (is_key) continue;
+        if (dict_find(&ds->column_names, jd.columns[c].name) >= 0) {
+            fprintf(stderr, "Warning: Join column '%s' is already loaded; skipping it.\n", jd.columns[c].name);
+            continue;
+        }
+        status = append_joined_column(ds, &jd, c, match);
+    }
+    if (status < 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+    } else {
+        if (duplicates) {
+            fprintf(stderr, "Warning: %d records of join file '%s' repeat an earlier key; the first one is used.\n",
+                    duplicates, file);
+        }
+        int matched = 0;
+        for (int r=0; r<ds->count; r++) matched += match[r] >= 0;
+        if (!quiet_load) fprintf(LOAD_LOG, "%d of %d records matched in %s\n", matched, ds->count, file);
+    }
+    free(match);
+    free_dataset(&jd);
+    return status;
+}
+
+/* Load either a snapshot or a CSV, telling them apart by the magic bytes.
+ * A stale snapshot falls back to re-parsing the CSV it was built from and
+ * redoing its joins and indexes. */
+static int load_dataset(const char *filename, Dataset *ds) {
+    char magic[8] = {0};
+    FILE *fp = fopen(filename, "rb");
+    if (fp) {
+        size_t got = fread(magic, 1, sizeof(magic), fp);
+        fclose(fp);
+        if (got == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, 8) == 0) {
+            SnapshotOrigin origin;
+            int status = load_snapshot(filename, ds, &origin);
+            if (status == 1) {
+                fprintf(stderr, "Warning: Snapshot '%s' is stale; reloading '%s'.\n", filename, origin.source);
+                status = load_demographics(origin.source, ds);
+                for (int j=0; status == 0 && j<origin.num_joins; j++) {
+                    status = join_dataset(ds, origin.joins[j]);
+                    if (status < 0) free_dataset(ds);
+                }
+                if (status == 0 && origin.indexed && build_indexes(ds) < 0) {
+                    free_dataset(ds);
+                    status = -1;
+                }
+                free_snapshot_origin(&origin);
+            }
+            return status;
+        }
+    }
+    return load_demographics(filename, ds);
+}
+
+/* Allocate a selection of 'count' rows without initializing its bits */
+static int selection_alloc(Selection *sel, int count) {
+    sel->count = count;
+    sel->num_words = (count + 63) / 64;
+    sel->bits = malloc(sizeof(uint64_t) * (sel->num_words ? sel->num_words : 1));
+    return sel->bits ? 0 : -1;
+}
+
+/* Allocate a selection with every row active */
+static int selection_init(Selection *sel, int count) {
+    if (selection_alloc(sel, count) < 0) return -1;
+    for (int w=0; w<sel->num_words; w++) {
+        sel->bits[w] = ~(uint64_t)0;
+    }
+    // Clear the padding bits past the last row
+    if (count % 64) {
+        sel->bits[sel->num_words-1] = ((uint64_t)1 << (count % 64)) - 1;
+    }
+    return 0;
+}
+
+static void selection_free(Selection *sel) {
+    free(sel->bits);
+    sel->bits = NULL;
+}
+
+/* Index of the first active row at or after 'from', or -1 */
+static inline int selection_next(const Selection *sel, int from) {
+    if (from >= sel->count) return -1;
+    int w = from / 64;
+    uint64_t word = sel->bits[w] & (~(uint64_t)0 << (from % 64));
+    while (!word) {
+        if (++w >= sel->num_words) return -1;
+        word = sel->bits[w];
+    }
+    return w*64 + __builtin_ctzll(word);
+}
+
+static inline void selection_clear(Selection *sel, int i) {
+    sel->bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static int selection_count(const Selection *sel) {
+    int n = 0;
+    for (int w=0; w<sel->num_words; w++) {
+        n += __builtin_popcountll(sel->bits[w]);
+    }
+    return n;
+}
+
+static inline int compare_value(float v, Comparison cmp, float x) {
+    switch (cmp) {
+    case CMP_GE: return v >= x;
+    case CMP_LE: return v <= x;
+    case CMP_GT: return v > x;
+    case CMP_LT: return v < x;
+    case CMP_EQ: return v == x;
+    case CMP_NE: return v < x || v > x;   // missing values (NaN) match nothing
+    }
+    return 0;
+}
+
+static int selection_copy(Selection *dst, const Selection *src) {
+    if (selection_alloc(dst, src->count) < 0) return -1;
+    memcpy(dst->bits, src->bits, sizeof(uint64_t)*src->num_words);
+    return 0;
+}
+
+static int query_state_init(QueryState *qs, int count) {
+    memset(qs, 0, sizeof(*qs));
+    return selection_init(&qs->sel, count);
+}
+
+static void query_state_free(QueryState *qs) {
+    selection_free(&qs->sel);
+    for (int d=0; d<qs->depth; d++) {
+        selection_free(&qs->stack[d]);
+    }
+    free(qs->stack);
+    for (int n=0; n<qs->saved_names.count; n++) {
+        selection_free(&qs->saved[n]);
+    }
+    free(qs->saved);
+    dict_free(&qs->saved_names);
+}
+
+/* Bit mask of the rows in [base, base+len) of col that satisfy cmp against x */
+static uint64_t filter_block_scalar(ColumnRef col, int base, int len, Comparison cmp, float x) {
+    uint64_t mask = 0;
+    for (int b=0; b<len; b++) {
+        mask |= (uint64_t)compare_value(column_value(col, base+b), cmp, x) << b;
+    }
+    return mask;
+}
+
+#ifdef HAVE_X86_SIMD
+/* 64 rows at a time, 4 lanes per compare. SSE2 is part of the x86-64 baseline.
+ * Every predicate is ordered, so NaN (a missing value) never matches. */
+__attribute__((target("sse2")))
+static uint64_t filter_block_sse2(ColumnRef col, int base, Comparison cmp, float x) {
+    __m128 t = _mm_set1_ps(x);
+    uint64_t mask = 0;
+    for (int k=0; k<64; k+=4) {
+        __m128 v = col.f ? _mm_loadu_ps(col.f + base + k)
+                         : _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(col.i + base + k)));
+        __m128 m;
+        switch (cmp) {
+        case CMP_GE: m = _mm_cmpge_ps(v, t); break;
+        case CMP_LE: m = _mm_cmple_ps(v, t); break;
+        case CMP_GT: m = _mm_cmpgt_ps(v, t); break;
+        case CMP_LT: m = _mm_cmplt_ps(v, t); break;
+        case CMP_EQ: m = _mm_cmpeq_ps(v, t); break;
+        default: m = _mm_and_ps(_mm_cmpneq_ps(v, t), _mm_cmpord_ps(v, v)); break;
+        }
+        mask |= (uint64_t)(unsigned)_mm_movemask_ps(m) << k;
+    }
+    return mask;
+}
+
+/* 64 rows at a time, 8 lanes per compare. Ordered compares reject NaN like the
+ * scalar path. */
+__attribute__((target("avx2")))
+static uint64_t filter_block_avx2(ColumnRef col, int base, Comparison cmp, float x) {
+    __m256 t = _mm256_set1_ps(x);
+    uint64_t mask = 0;
+    for (int k=0; k<64; k+=8) {
+        __m256 v = col.f ? _mm256_loadu_ps(col.f + base + k)
+                         : _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(col.i + base + k)));
+        __m256 m;
+        switch (cmp) {
+        case CMP_GE: m = _mm256_cmp_ps(v, t, _CMP_GE_OQ); break;
+        case CMP_LE: m = _mm256_cmp_ps(v, t, _CMP_LE_OQ); break;
+        case CMP_GT: m = _mm256_cmp_ps(v, t, _CMP_GT_OQ); break;
+        case CMP_LT: m = _mm256_cmp_ps(v, t, _CMP_LT_OQ); break;
+        case CMP_EQ: m = _mm256_cmp_ps(v, t, _CMP_EQ_OQ); break;
+        default: m = _mm256_cmp_ps(v, t, _CMP_NEQ_OQ); break;
+        }
+        mask |= (uint64_t)(unsigned)_mm256_movemask_ps(m) << k;
+    }
+    return mask;
+}
+#endif
+
+typedef enum {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+} SimdLevel;
+
+/* Widest filter kernel the running CPU supports */
+static SimdLevel simd_level(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_NONE;
+}
+
+/* First index position whose value is >= x (or > x when after is set) */
+static int index_search(ColumnRef col, int n, float x, int after) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        float v = column_value(col, col.order[mid]);
+        if (after ? v <= x : v < x) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Index positions before the missing values (NaN), which sort last */
+static int index_known(ColumnRef col, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        float v = column_value(col, col.order[mid]);
+        if (v == v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void scatter_rows(Selection *out, const int *rows, int n) {
+    for (int k=0; k<n; k++) {
+        out->bits[rows[k] >> 6] |= 1ull << (rows[k] & 63);
+    }
+}
+
+/* Set the bits of rows[0..n) in out, then keep only those also in in */
+static void select_rows(const Selection *in, Selection *out, const int *rows, int n) {
+    memset(out->bits, 0, sizeof(uint64_t)*out->num_words);
+    scatter_rows(out, rows, n);
+    for (int w=0; w<in->num_words; w++) {
+        out->bits[w] &= in->bits[w];
+    }
+}
+
+/* Rows matching at most this share of the table are looked up through an
+ * index; above it the vector scan is cheaper than scattering bits */
+#define INDEX_MAX_FRACTION 8
+
+/* out = the rows of 'in' whose value in col satisfies cmp against x.
+ * Words with no active rows are skipped, so chained filters get cheaper. */
+static void filter_column(const Selection *in, Selection *out, ColumnRef col, Comparison cmp, float x) {
+    if (col.order && cmp != CMP_NE) {
+        // Ranges end before the missing values, which match no comparison
+        int n = in->count, known = index_known(col, n), lo = 0, hi = known;
+        if (cmp == CMP_GE || cmp == CMP_EQ) lo = index_search(col, known, x, 0);
+        if (cmp == CMP_GT) lo = index_search(col, known, x, 1);
+        if (cmp == CMP_LE || cmp == CMP_EQ) hi = index_search(col, known, x, 1);
+        if (cmp == CMP_LT) hi = index_search(col, known, x, 0);
+        if (hi < lo) hi = lo;
+        if ((long long)(hi - lo)*INDEX_MAX_FRACTION <= n) {
+            select_rows(in, out, col.order + lo, hi - lo);
+            return;
+        }
+    }
+
+    SimdLevel level = simd_level();
+    int full_words = in->count / 64;
+    for (int w=0; w<in->num_words; w++) {
+        if (!in->bits[w]) {
+            out->bits[w] = 0;
+            continue;
+        }
+        int base = w*64;
+        uint64_t mask;
+        if (w >= full_words) {
+            mask = filter_block_scalar(col, base, in->count - base, cmp, x);
+        }
+#ifdef HAVE_X86_SIMD
+        else if (level == SIMD_AVX2) {
+            mask = filter_block_avx2(col, base, cmp, x);
+        } else if (level == SIMD_SSE2) {
+            mask = filter_block_sse2(col, base, cmp, x);
+        }
+#endif
+        else {
+            mask = filter_block_scalar(col, base, 64, cmp, x);
+        }
+        out->bits[w] = in->bits[w] & mask;
+    }
+}
+
+static int string_matches(const char *s, StringMatch match, char *const *values, int num_values) {
+    switch (match) {
+    case MATCH_EQ:
+        return strcmp(s, values[0]) == 0;
+    case MATCH_NE:
+        return strcmp(s, values[0]) != 0;
+    case MATCH_IN:
+        for (int v=0; v<num_values; v++) {
+            if (strcmp(s, values[v]) == 0) return 1;
+        }
+        return 0;
+    case MATCH_PREFIX:
+        return strncmp(s, values[0], strlen(values[0])) == 0;
+    case MATCH_CONTAINS:
+        return strstr(s, values[0]) != NULL;
+    }
+    return 0;
+}
+
+static void free_predicate(Predicate *p) {
+    if (!p) return;
+    free_predicate(p->left);
+    free_predicate(p->right);
+    for (int v=0; v<p->num_values; v++) {
+        free(p->values[v]);
+    }
+    free(p->values);
+    free(p->code_match);
+    free(p);
+}
+
+/* Evaluate p over the rows set in 'in', writing the matching subset to 'out'.
+ * Operands short-circuit: the right side of 'and' only sees rows the left kept,
+ * and the right side of 'or' only sees rows the left rejected. */
+static int eval_predicate(const Predicate *p, const Selection *in, Selection *out) {
+    switch (p->kind) {
+    case PRED_NUMERIC:
+        filter_column(in, out, p->column, p->cmp, p->number);
+        return 0;
+    case PRED_CODES:
+    case PRED_STRING: {
+        if (p->kind == PRED_CODES && p->code_rows) {
+            // The rows of each code are one run of the index
+            long long matched = 0;
+            for (int k=0; k<p->num_codes; k++) {
+                if (p->code_match[k]) matched += p->code_start[k+1] - p->code_start[k];
+            }
+            if (matched*INDEX_MAX_FRACTION <= in->count) {
+                memset(out->bits, 0, sizeof(uint64_t)*out->num_words);
+                for (int k=0; k<p->num_codes; k++) {
+                    if (p->code_match[k]) scatter_rows(out, p->code_rows + p->code_start[k], p->code_start[k+1] - p->code_start[k]);
+                }
+                for (int w=0; w<in->num_words; w++) {
+                    out->bits[w] &= in->bits[w];
+                }
+                return 0;
+            }
+        }
+        for (int w=0; w<in->num_words; w++) {
+            uint64_t word = in->bits[w];
+            uint64_t keep = 0;
+            while (word) {
+                int b = __builtin_ctzll(word);
+                int i = w*64 + b;
+                int hit = (p->kind == PRED_CODES) ? p->code_match[p->codes[i]]
+                                                  : string_matches(p->strings[i], p->match, p->values, p->num_values);
+                keep |= (uint64_t)(hit != 0) << b;
+                word &= word - 1;
+            }
+            out->bits[w] = keep;
+        }
+        return 0;
+    }
+    case PRED_AND: {
+        Selection tmp;
+        if (selection_alloc(&tmp, in->count) < 0) return -1;
+        int status = eval_predicate(p->left, in, &tmp);
+        if (status == 0) status = eval_predicate(p->right, &tmp, out);
+        selection_free(&tmp);
+        return status;
+    }
+    case PRED_OR: {
+        Selection left, rest;
+        if (selection_alloc(&left, in->count) < 0) return -1;
+        if (selection_alloc(&rest, in->count) < 0) {
+            selection_free(&left);
+            return -1;
+        }
+        int status = eval_predicate(p->left, in, &left);
+        if (status == 0) {
+            for (int w=0; w<in->num_words; w++) {
+                rest.bits[w] = in->bits[w] & ~left.bits[w];
+            }
+            status = eval_predicate(p->right, &rest, out);
+            for (int w=0; w<in->num_words; w++) {
+                out->bits[w] |= left.bits[w];
+            }
+        }
+        selection_free(&left);
+        selection_free(&rest);
+        return status;
+    }
+    case PRED_NOT: {
+        Selection tmp;
+        if (selection_alloc(&tmp, in->count) < 0) return -1;
+        int status = eval_predicate(p->left, in, &tmp);
+        for (int w=0; w<in->num_words; w++) {
+            out->bits[w] = in->bits[w] & ~tmp.bits[w];
+        }
+        selection_free(&tmp);
+        return status;
+    }
+    }
+    return -1;
+}
+
+/* Column of a required display field; load_demographics guarantees it exists */
+static ColumnRef display_column(const Dataset *ds, const char *name) {
+    return resolve_column(ds, find_column(ds, name));
+}
+
+static inline int column_int(ColumnRef col, int i) {
+    return col.i ? col.i[i] : (int)col.f[i];
+}
+
+static void output_flush(Output *o) {
+    if (o->len) fwrite(o->buf, 1, o->len, o->fp);
+    o->written += o->len;
+    o->len = 0;
+}
+
+static inline char *output_reserve(Output *o, size_t n) {
+    if (o->len + n > sizeof(o->buf)) output_flush(o);
+    return o->buf + o->len;
+}
+
+static void output_bytes(Output *o, const char *s, size_t n) {
+    if (n > sizeof(o->buf)) {
+        output_flush(o);
+        fwrite(s, 1, n, o->fp);
+        o->written += n;
+        return;
+    }
+    memcpy(output_reserve(o, n), s, n);
+    o->len += n;
+}
+
+static inline void output_str(Output *o, const char *s) {
+    output_bytes(o, s, strlen(s));
+}
+
+static inline void output_char(Output *o, char c) {
+    *output_reserve(o, 1) = c;
+    o->len++;
+}
+
+/* Decimal digits of v, most significant first; returns the digit count */
+static inline int format_digits(char *out, unsigned long long v) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (int k=0; k<n; k++) out[k] = tmp[n-1-k];
+    return n;
+}
+
+static void output_int(Output *o, int v) {
+    char *p = output_reserve(o, 12);
+    int n = 0;
+    unsigned long long u = (unsigned long long)v;
+    if (v < 0) {
+        p[n++] = '-';
+        u = 0 - u;
+        u &= 0xffffffffull;
+    }
+    o->len += n + format_digits(p + n, u);
+}
+
+/* Same text as printf("%f", v): the exact binary value scaled by 10^6 and
+ * rounded half to even. Values too large for 64-bit scaling use snprintf. */
+static void output_float(Output *o, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    int biased = (int)((bits >> 23) & 0xff);
+    uint64_t m = bits & 0x7fffff;
+    int shift;
+    if (biased == 0) {
+        shift = 149;
+    } else {
+        m |= 0x800000;
+        shift = 150 - biased;
+    }
+
+    uint64_t scaled;
+    if (biased == 0xff || shift < -16) {
+        char *p = output_reserve(o, 64);
+        int n = snprintf(p, 64, "%f", v);
+        if (n >= 64) {
+            output_flush(o);
+            p = output_reserve(o, 64);
+            n = snprintf(p, 64, "%f", v);
+        }
+        o->len += n < 64 ? n : 63;
+        return;
+    } else if (shift <= 0) {
+        scaled = (m << -shift) * 1000000u;
+    } else if (shift >= 64) {
+        scaled = 0;     // below 2^-40, rounds to zero
+    } else {
+        uint64_t n = m * 1000000u;
+        uint64_t rem = n & ((1ull << shift) - 1), half = 1ull << (shift - 1);
+        scaled = n >> shift;
+        if (rem > half || (rem == half && (scaled & 1))) scaled++;
+    }
+
+    char *p = output_reserve(o, 32);
+    int n = 0;
+    if (bits >> 31) p[n++] = '-';
+    n += format_digits(p + n, scaled / 1000000u);
+    p[n++] = '.';
+    unsigned frac = (unsigned)(scaled % 1000000u);
+    for (int k=5; k>=0; k--) {
+        p[n+k] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    o->len += n + 6;
+}
+
+/* CSV field, quoted when it holds a separator, quote or line break */
+static void output_csv_string(Output *o, const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) {
+        output_str(o, s);
+        return;
+    }
+    output_char(o, '"');
+    for (; *s; s++) {
+        if (*s == '"') output_char(o, '"');
+        output_char(o, *s);
+    }
+    output_char(o, '"');
+}
+
+static void output_json_string(Output *o, const char *s) {
+    output_char(o, '"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            output_char(o, '\\');
+            output_char(o, (char)c);
+        } else if (c < 0x20) {
+            // Six characters plus the NUL snprintf writes after them
+            char *p = output_reserve(o, 7);
+            o->len += snprintf(p, 7, "\\u%04x", c);
+        } else {
+            output_char(o, (char)c);
+        }
+    }
+    output_char(o, '"');
+}
+
+/* printf into the buffer, for the status and result lines around records */
+static void output_printf(Output *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *p = output_reserve(o, 512);
+    int n = vsnprintf(p, 512, fmt, ap);
+    va_end(ap);
+    if (n >= 512) {
+        char *line;
+        va_start(ap, fmt);
+        n = vasprintf(&line, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        output_bytes(o, line, n);
+        free(line);
+        return;
+    }
+    if (n > 0) o->len += n;
+}
+
+/* --format=jsonl status and result lines are objects too: this opens one
+ * as {"op":"<op>"; the caller adds its fields and closes it */
+static void output_status(Output *o, const char *op) {
+    output_str(o, "{\"op\":");
+    output_json_string(o, op);
+}
+
+/* ,"<key>":"<value>" inside a status object */
+static void output_status_text(Output *o, const char *key, const char *value) {
+    output_printf(o, ",\"%s\":", key);
+    output_json_string(o, value);
+}
+
+/* "Filter: <label> (<n> entries)", or its object */
+static void output_filter_status(Output *o, const char *label, long long entries) {
+    if (o->format == FORMAT_JSONL) {
+        output_status(o, "filter");
+        output_status_text(o, "filter", label);
+        output_printf(o, ",\"entries\":%lld}\n", entries);
+    } else {
+        output_printf(o, "Filter: %s (%lld entries)\n", label, entries);
+    }
+}
+
+/* "Scope: <op> [name] (<n> entries)", or its object */
+static void output_scope_status(Output *o, const char *op, const char *name, int entries) {
+    if (o->format == FORMAT_JSONL) {
+        output_status(o, op);
+        if (name) output_status_text(o, "name", name);
+        output_printf(o, ",\"entries\":%d}\n", entries);
+    } else {
+        output_printf(o, "Scope: %s%s%s (%d entries)\n", op, name ? " " : "", name ? name : "", entries);
+    }
+}
+
+/* Errors go to err once everything written before them has gone out */
+static void output_error(Output *o, const char *fmt, ...) {
+    output_flush(o);
+    if (o->err == o->fp) fflush(o->fp);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(o->err, fmt, ap);
+    va_end(ap);
+}
+
+/* Columns printed for each record by display, top: and sort: */
+typedef struct {
+    const Column *county;
+    const Column *state;
+    ColumnRef pop;
+    ColumnRef edu_hs;
+    ColumnRef edu_bachelors;
+    ColumnRef eth_ai;
+    ColumnRef eth_asian;
+    ColumnRef eth_black;
+    ColumnRef eth_hisp;
+    ColumnRef eth_nhpi;
+    ColumnRef eth_2more;
+    ColumnRef eth_white;
+    ColumnRef eth_white_non_hisp;
+    ColumnRef income_median;
+    ColumnRef income_percap;
+    ColumnRef income_poverty;
+} DisplayColumns;
+
+/* How records are written: the fixed text layout, or a list of columns */
+typedef struct {
+    const Dataset *ds;
+    DisplayColumns dc;
+    const int *fields;
+    int num_fields;
+    int default_fields[NUM_DISPLAY_FIELDS];
+} RecordLayout;
+
+static void record_layout(const Dataset *ds, const Operation *op, RecordLayout *layout) {
+    DisplayColumns *dc = &layout->dc;
+    layout->ds = ds;
+    dc->county = &ds->columns[ds->col_county];
+    dc->state = &ds->columns[ds->col_state];
+    dc->pop = resolve_column(ds, ds->col_pop);
+    dc->edu_hs = display_column(ds, "Education.High School or Higher");
+    dc->edu_bachelors = display_column(ds, "Education.Bachelor's Degree or Higher");
+    dc->eth_ai = display_column(ds, "Ethnicities.American Indian and Alaska Native Alone");
+    dc->eth_asian = display_column(ds, "Ethnicities.Asian Alone");
+    dc->eth_black = display_column(ds, "Ethnicities.Black Alone");
+    dc->eth_hisp = display_column(ds, "Ethnicities.Hispanic or Latino");
+    dc->eth_nhpi = display_column(ds, "Ethnicities.Native Hawaiian and Other Pacific Islander Alone");
+    dc->eth_2more = display_column(ds, "Ethnicities.Two or More Races");
+    dc->eth_white = display_column(ds, "Ethnicities.White Alone");
+    dc->eth_white_non_hisp = display_column(ds, "Ethnicities.White Alone not Hispanic or Latino");
+    dc->income_median = display_column(ds, "Income.Median Household Income");
+    dc->income_percap = display_column(ds, "Income.Per Capita Income");
+    dc->income_poverty = display_column(ds, "Income.Persons Below Poverty Level");
+
+    for (int k=0; k<NUM_DISPLAY_FIELDS; k++) {
+        layout->default_fields[k] = find_column(ds, display_fields[k]);
+    }
+    layout->fields = op->fields ? op->fields : layout->default_fields;
+    layout->num_fields = op->fields ? op->num_fields : NUM_DISPLAY_FIELDS;
+}
+
+static void output_text_value(Output *o, const char *label, ColumnRef col, int i, int is_percent) {
+    output_str(o, label);
+    if (is_percent) {
+        output_float(o, column_value(col, i));
+        output_str(o, "%\n");
+    } else if (column_value(col, i) != column_value(col, i)) {
+        output_str(o, "nan\n");
+    } else {
+        output_int(o, column_int(col, i));
+        output_char(o, '\n');
+    }
+}
+
+/* The original display layout of one record */
+static void output_text_record(Output *o, const DisplayColumns *dc, int i) {
+    output_str(o, dc->county->s[i]);
+    output_str(o, ", ");
+    output_str(o, dc->state->dict.strings[dc->state->codes[i]]);
+    output_char(o, '\n');
+    output_text_value(o, "        Population: ", dc->pop, i, 0);
+    output_str(o, "        Education\n");
+    output_text_value(o, "                >= High School: ", dc->edu_hs, i, 1);
+    output_text_value(o, "                >= Bachelor's: ", dc->edu_bachelors, i, 1);
+    output_str(o, "        Ethnicity Percentages\n");
+    output_text_value(o, "                American Indian and Alaska Native: ", dc->eth_ai, i, 1);
+    output_text_value(o, "                Asian Alone: ", dc->eth_asian, i, 1);
+    output_text_value(o, "                Black Alone: ", dc->eth_black, i, 1);
+    output_text_value(o, "                Hispanic or Latino: ", dc->eth_hisp, i, 1);
+    output_text_value(o, "                Native Hawaiian and Other Pacific Islander Alone: ", dc->eth_nhpi, i, 1);
+    output_text_value(o, "                Two or More Races: ", dc->eth_2more, i, 1);
+    output_text_value(o, "                White Alone: ", dc->eth_white, i, 1);
+    output_text_value(o, "                White Alone, not Hispanic or Latino: ", dc->eth_white_non_hisp, i, 1);
+    output_str(o, "        Income\n");
+    output_text_value(o, "                Median Household: ", dc->income_median, i, 0);
+    output_text_value(o, "                Per Capita: ", dc->income_percap, i, 0);
+    output_text_value(o, "                Below Poverty Level: ", dc->income_poverty, i, 1);
+    output_char(o, '\n');
+}
+
+/* One field of row i; strings go through the format's quoting */
+static void output_field(Output *o, const Column *c, int i) {
+    switch (c->type) {
+    case COL_INT:
+        output_int(o, c->i[i]);
+        break;
+    case COL_FLOAT:
+        if (c->f[i] != c->f[i]) {
+            output_str(o, o->format == FORMAT_JSONL ? "null" : o->format == FORMAT_CSV ? "" : "nan");
+        } else {
+            output_float(o, c->f[i]);
+        }
+        break;
+    default: {
+        const char *s = c->type == COL_INTERNED ? c->dict.strings[c->codes[i]] : c->s[i] ? c->s[i] : "";
+        if (o->format == FORMAT_CSV) {
+            output_csv_string(o, s);
+        } else if (o->format == FORMAT_JSONL) {
+            output_json_string(o, s);
+        } else {
+            output_str(o, s);
+        }
+        break;
+    }
+    }
+}
+
+/* csv writes a header row ahead of each display, top: or sort: */
+static void output_header(Output *o, const RecordLayout *layout) {
+    if (o->format != FORMAT_CSV) return;
+    for (int k=0; k<layout->num_fields; k++) {
+        if (k) output_char(o, ',');
+        output_csv_string(o, layout->ds->columns[layout->fields[k]].name);
+    }
+    output_char(o, '\n');
+}
+
+static void output_record(Output *o, const RecordLayout *layout, const Operation *op, int i) {
+    const Column *columns = layout->ds->columns;
+    if (o->format == FORMAT_TEXT && !op->fields) {
+        output_text_record(o, &layout->dc, i);
+    } else if (o->format == FORMAT_TEXT) {
+        const DisplayColumns *dc = &layout->dc;
+        output_str(o, dc->county->s[i]);
+        output_str(o, ", ");
+        output_str(o, dc->state->dict.strings[dc->state->codes[i]]);
+        output_char(o, '\n');
+        for (int k=0; k<layout->num_fields; k++) {
+            output_str(o, "        ");
+            output_str(o, columns[layout->fields[k]].name);
+            output_str(o, ": ");
+            output_field(o, &columns[layout->fields[k]], i);
+            output_char(o, '\n');
+        }
+        output_char(o, '\n');
+    } else if (o->format == FORMAT_CSV) {
+        for (int k=0; k<layout->num_fields; k++) {
+            if (k) output_char(o, ',');
+            output_field(o, &columns[layout->fields[k]], i);
+        }
+        output_char(o, '\n');
+    } else {
+        output_char(o, '{');
+        for (int k=0; k<layout->num_fields; k++) {
+            if (k) output_char(o, ',');
+            output_json_string(o, columns[layout->fields[k]].name);
+            output_char(o, ':');
+            output_field(o, &columns[layout->fields[k]], i);
+        }
+        output_str(o, "}\n");
+    }
+}
+
+/* display[:<field>,<field>...]: print all active records */
+static void op_display(const Dataset *ds, const Selection *sel, const Operation *op, Output *o) {
+    RecordLayout layout;
+    record_layout(ds, op, &layout);
+    output_header(o, &layout);
+    for (int i=selection_next(sel, 0); i>=0; i=selection_next(sel, i+1)) {
+        output_record(o, &layout, op, i);
+    }
+    output_flush(o);
+}
+
+/* Ordering used by top: and sort: - by value, ties in file order */
+typedef struct {
+    ColumnRef column;
+    int descending;
+} RowOrder;
+
+static inline int row_before(const RowOrder *order, int a, int b) {
+    float x = column_value(order->column, a), y = column_value(order->column, b);
+    int x_missing = x != x, y_missing = y != y;
+    if (x_missing || y_missing) return x_missing == y_missing ? a < b : y_missing;
+    if (x != y) return order->descending ? x > y : x < y;
+    return a < b;
+}
+
+static int compare_rows(const void *a, const void *b, void *arg) {
+    int x = *(const int *)a, y = *(const int *)b;
+    if (row_before(arg, x, y)) return -1;
+    return row_before(arg, y, x);
+}
+
+static void heap_sift_down(int *heap, int n, int at, const RowOrder *order) {
+    for (;;) {
+        int child = 2*at + 1;
+        if (child >= n) break;
+        // Root holds the row that would come last among those kept
+        if (child+1 < n && row_before(order, heap[child], heap[child+1])) child++;
+        if (!row_before(order, heap[at], heap[child])) break;
+        int t = heap[at];
+        heap[at] = heap[child];
+        heap[child] = t;
+        at = child;
+    }
+}
+
+/* top:<N>:<field>:asc|desc and sort:<field>[:asc|desc] - print the active
+ * records in field order. top keeps a bounded heap of the best N row ids,
+ * O(n log N); sort orders a permutation of all active ids. Neither moves
+ * any column data. */
+static void op_ordered(const Dataset *ds, const Selection *sel, const Operation *op, Output *o) {
+    RowOrder order = {op->column, op->descending};
+    int count = selection_count(sel);
+    int limit = op->kind == OP_TOP && op->limit < count ? op->limit : count;
+    int *rows = malloc(sizeof(int)*(limit ? limit : 1));
+    if (!rows) {
+        output_error(o, "Error: Out of memory.\n");
+        return;
+    }
+
+    int n = 0;
+    for (int i=selection_next(sel, 0); i>=0; i=selection_next(sel, i+1)) {
+        if (n < limit) {
+            rows[n++] = i;
+            if (n == limit && op->kind == OP_TOP) {
+                for (int at=n/2-1; at>=0; at--) heap_sift_down(rows, n, at, &order);
+            }
+        } else if (limit && row_before(&order, i, rows[0])) {
+            rows[0] = i;
+            heap_sift_down(rows, n, 0, &order);
+        }
+    }
+    qsort_r(rows, n, sizeof(int), compare_rows, &order);
+
+    if (o->format == FORMAT_JSONL) {
+        output_status(o, op->kind == OP_TOP ? "top" : "sort");
+        output_status_text(o, "field", op->name);
+        output_printf(o, ",\"order\":\"%s\"", op->descending ? "desc" : "asc");
+        if (op->kind == OP_TOP) output_printf(o, ",\"limit\":%d", op->limit);
+        output_printf(o, ",\"entries\":%d}\n", n);
+    } else if (op->kind == OP_TOP) {
+        output_printf(o, "Top: %d %s %s (%d entries)\n", op->limit, op->name, op->descending ? "desc" : "asc", n);
+    } else {
+        output_printf(o, "Sort: %s %s (%d entries)\n", op->name, op->descending ? "desc" : "asc", n);
+    }
+    RecordLayout layout;
+    record_layout(ds, op, &layout);
+    output_header(o, &layout);
+    for (int k=0; k<n; k++) {
+        output_record(o, &layout, op, rows[k]);
+    }
+    output_flush(o);
+    free(rows);
+}
+
+/* filter-state:, filter: and where: - keep only the rows matching the predicate */
+static void op_filter(Selection *sel, const Operation *op, Output *o) {
+    Selection out;
+    if (selection_alloc(&out, sel->count) < 0 || eval_predicate(op->pred, sel, &out) < 0) {
+        selection_free(&out);
+        output_error(o, "Error: Out of memory.\n");
+        return;
+    }
+    free(sel->bits);
+    sel->bits = out.bits;
+    output_filter_status(o, op->label, selection_count(sel));
+}
+
+static int is_aggregate(const Operation *op) {
+    return op->kind == OP_POPULATION_TOTAL || op->kind == OP_POPULATION_SUB || op->kind == OP_PERCENT;
+}
+
+static int group_table_reserve(GroupTable *t, int capacity) {
+    if (capacity <= t->capacity) return 0;
+    GroupTotals *groups = realloc(t->groups, sizeof(GroupTotals)*capacity);
+    if (!groups) return -1;
+    t->groups = groups;
+    double *sums = realloc(t->sums, sizeof(double)*capacity*(t->num_ops ? t->num_ops : 1));
+    if (!sums) return -1;
+    t->sums = sums;
+    long long *missing = realloc(t->missing, sizeof(long long)*capacity*(t->num_ops ? t->num_ops : 1));
+    if (!missing) return -1;
+    t->missing = missing;
+    t->capacity = capacity;
+    return 0;
+}
+
+static int group_table_add(GroupTable *t, int code, long long bucket) {
+    if (t->count >= t->capacity && group_table_reserve(t, t->capacity ? t->capacity*2 : 64) < 0) return -1;
+    int g = t->count++;
+    t->groups[g].total_pop = 0;
+    t->groups[g].count = 0;
+    t->groups[g].code = code;
+    t->groups[g].bucket = bucket;
+    for (int k=0; k<t->num_ops; k++) {
+        t->sums[(size_t)g*t->num_ops + k] = 0.0;
+        t->missing[(size_t)g*t->num_ops + k] = 0;
+    }
+    return g;
+}
+
+static inline uint32_t bucket_slot(long long bucket, int num_slots) {
+    return (uint32_t)(((uint64_t)bucket * 0x9E3779B97F4A7C15ull) >> 32) & (uint32_t)(num_slots - 1);
+}
+
+/* Group id of a numeric bucket, adding the group on first sight; -1 on allocation failure */
+static int group_for_bucket(GroupTable *t, long long bucket) {
+    if (t->num_slots) {
+        for (uint32_t slot = bucket_slot(bucket, t->num_slots); t->bucket_ids[slot] >= 0;
+             slot = (slot+1) & (uint32_t)(t->num_slots - 1)) {
+            if (t->bucket_keys[slot] == bucket) return t->bucket_ids[slot];
+        }
+    }
+    if ((t->count+1)*2 > t->num_slots) {
+        int num_slots = t->num_slots ? t->num_slots*2 : 64;
+        long long *keys = malloc(sizeof(long long)*num_slots);
+        int *ids = malloc(sizeof(int)*num_slots);
+        if (!keys || !ids) {
+            free(keys);
+            free(ids);
+            return -1;
+        }
+        for (int n=0; n<num_slots; n++) ids[n] = -1;
+        for (int g=0; g<t->count; g++) {
+            uint32_t slot = bucket_slot(t->groups[g].bucket, num_slots);
+            while (ids[slot] >= 0) slot = (slot+1) & (uint32_t)(num_slots - 1);
+            keys[slot] = t->groups[g].bucket;
+            ids[slot] = g;
+        }
+        free(t->bucket_keys);
+        free(t->bucket_ids);
+        t->bucket_keys = keys;
+        t->bucket_ids = ids;
+        t->num_slots = num_slots;
+    }
+    int g = group_table_add(t, -1, bucket);
+    if (g < 0) return -1;
+    uint32_t slot = bucket_slot(bucket, t->num_slots);
+    while (t->bucket_ids[slot] >= 0) slot = (slot+1) & (uint32_t)(t->num_slots - 1);
+    t->bucket_keys[slot] = bucket;
+    t->bucket_ids[slot] = g;
+    return g;
+}
+
+static void group_table_free(GroupTable *t) {
+    free(t->groups);
+    free(t->sums);
+    free(t->missing);
+    free(t->bucket_keys);
+    free(t->bucket_ids);
+}
+
+/* Groups print in key order: state codes alphabetically, buckets ascending */
+static int compare_groups(const void *a, const void *b, void *arg) {
+    const GroupTotals *x = *(const GroupTotals *const *)a;
+    const GroupTotals *y = *(const GroupTotals *const *)b;
+    char *const *strings = arg;
+    if (x->code >= 0) return strcmp(strings[x->code], strings[y->code]);
+    return (x->bucket > y->bucket) - (x->bucket < y->bucket);
+}
+
+/* A percentage is over the population of the rows that have the field */
+static void print_aggregates(Output *o, const Operation *ops, int num_ops, long long total_pop,
+                             const double *sums, const long long *missing) {
+    for (int k=0; k<num_ops; k++) {
+        const Operation *op = &ops[k];
+        long long known_pop = total_pop - missing[k];
+        if (o->format == FORMAT_JSONL) {
+            if (op->kind == OP_POPULATION_TOTAL) {
+                output_status(o, "population-total");
+                output_printf(o, ",\"population\":%lld}\n", total_pop);
+                continue;
+            }
+            output_status(o, op->kind == OP_POPULATION_SUB ? "population" : "percent");
+            output_status_text(o, "field", op->name);
+            if (op->kind == OP_POPULATION_SUB) {
+                output_printf(o, ",\"population\":%f}\n", sums[k]);
+            } else {
+                output_printf(o, ",\"percentage\":%f}\n", known_pop ? (sums[k] / (double)known_pop)*100.0 : 0.0);
+            }
+        } else if (op->kind == OP_POPULATION_TOTAL) {
+            output_printf(o, "2014 population: %lld\n", total_pop);
+        } else if (op->kind == OP_POPULATION_SUB) {
+            output_printf(o, "2014 %s population: %f\n", op->name, sums[k]);
+        } else if (known_pop == 0) {
+            output_printf(o, "2014 %s percentage: 0\n", op->name);
+        } else {
+            double percentage = (sums[k] / (double)known_pop)*100.0;
+            output_printf(o, "2014 %s percentage: %f\n", op->name, percentage);
+        }
+    }
+}
+
+/* Selection words per aggregate block (64K rows). Each block is summed on
+ * its own in row order and block results are added in block order, so the
+ * totals are the same whatever number of threads shares the blocks. */
+#define AGGREGATE_BLOCK_WORDS 1024
+
+/* One aggregate run split into blocks; thread t takes blocks t, t+n, ... */
+typedef struct {
+    const Dataset *ds;
+    const Selection *sel;
+    const GroupKey *group;
+    const Operation *ops;
+    int num_ops;
+    GroupTable *tables;     // one per block
+    int num_blocks;
+    int stride;
+    int first;
+    int failed;
+} AggregateJob;
+
+static int group_table_init(GroupTable *t, const Column *key, int num_ops) {
+    memset(t, 0, sizeof(*t));
+    t->num_ops = num_ops;
+    int reserve = key && key->type == COL_INTERNED ? key->dict.count : 1;
+    if (group_table_reserve(t, reserve < 1 ? 1 : reserve) < 0) return -1;
+    if (!key) {
+        group_table_add(t, -1, 0);
+    } else if (key->type == COL_INTERNED) {
+        for (int code=0; code<key->dict.count; code++) {
+            group_table_add(t, code, 0);
+        }
+    }
+    return 0;
+}
+
+/* Sums for the active rows of one block. Active row ids are gathered a word
+ * at a time and each sum then walks that batch in row order. */
+static int aggregate_block(const AggregateJob *job, int block, GroupTable *table) {
+    const int *pop = job->ds->columns[job->ds->col_pop].i;
+    const GroupKey *group = job->group;
+    const Column *key = group ? group->column : NULL;
+    const Selection *sel = job->sel;
+    int num_ops = job->num_ops;
+    if (group_table_init(table, key, num_ops) < 0) return -1;
+
+    int idx[64], gid[64];
+    int end = (block + 1)*AGGREGATE_BLOCK_WORDS;
+    if (end > sel->num_words) end = sel->num_words;
+    for (int w=block*AGGREGATE_BLOCK_WORDS; w<end; w++) {
+        uint64_t word = sel->bits[w];
+        int m = 0;
+        while (word) {
+            idx[m++] = w*64 + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+        int n = 0;
+        for (int t=0; t<m; t++) {
+            if (!key) {
+                gid[n] = 0;
+            } else if (key->type == COL_INTERNED) {
+                gid[n] = key->codes[idx[t]];
+            } else {
+                // Rows without a value fall in no bucket
+                double v = column_value(group->values, idx[t]);
+                if (v != v) continue;
+                gid[n] = group_for_bucket(table, (long long)floor(v / group->width));
+                if (gid[n] < 0) return -1;
+            }
+            idx[n] = idx[t];
+            table->groups[gid[n]].total_pop += pop[idx[n]];
+            table->groups[gid[n]].count++;
+            n++;
+        }
+        for (int k=0; k<num_ops; k++) {
+            if (job->ops[k].kind == OP_POPULATION_TOTAL) continue;
+            ColumnRef col = job->ops[k].column;
+            double *sums = table->sums + k;
+            long long *missing = table->missing + k;
+            for (int t=0; t<n; t++) {
+                double v = column_value(col, idx[t]);
+                if (v != v) {
+                    missing[(size_t)gid[t]*num_ops] += pop[idx[t]];
+                } else {
+                    sums[(size_t)gid[t]*num_ops] += (double)pop[idx[t]] * (v / 100.0);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void *aggregate_worker(void *arg) {
+    AggregateJob *job = arg;
+    for (int b=job->first; b<job->num_blocks; b+=job->stride) {
+        if (aggregate_block(job, b, &job->tables[b]) < 0) job->failed = 1;
+    }
+    return NULL;
+}
+
+/* Add src's groups into dst, matching buckets by key */
+static int group_table_merge(GroupTable *dst, const GroupTable *src, const Column *key) {
+    for (int g=0; g<src->count; g++) {
+        const GroupTotals *from = &src->groups[g];
+        if (!from->count) continue;
+        int d = !key || key->type == COL_INTERNED ? g : group_for_bucket(dst, from->bucket);
+        if (d < 0) return -1;
+        dst->groups[d].total_pop += from->total_pop;
+        dst->groups[d].count += from->count;
+        for (int k=0; k<src->num_ops; k++) {
+            dst->sums[(size_t)d*dst->num_ops + k] += src->sums[(size_t)g*src->num_ops + k];
+            dst->missing[(size_t)d*dst->num_ops + k] += src->missing[(size_t)g*src->num_ops + k];
+        }
+    }
+    return 0;
+}
+
+/* Totals of a run of consecutive aggregate ops, evaluated in one pass over
+ * the active rows on up to thread_count() threads. Every result matches
+ * evaluating its op on its own, and under group-by each group's sums come
+ * out exactly as filtering to that group first would give. */
+static int aggregate_totals(const Dataset *ds, const Selection *sel, const GroupKey *group,
+                            const Operation *ops, int num_ops, GroupTable *table) {
+    const Column *key = group ? group->column : NULL;
+    int num_blocks = (sel->num_words + AGGREGATE_BLOCK_WORDS - 1) / AGGREGATE_BLOCK_WORDS;
+    if (num_blocks < 1) num_blocks = 1;
+    memset(table, 0, sizeof(*table));
+    GroupTable *tables = calloc(num_blocks, sizeof(GroupTable));
+    if (!tables) return -1;
+
+    AggregateJob jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int num_threads = thread_count();
+    if (num_threads > num_blocks) num_threads = num_blocks;
+    for (int t=0; t<num_threads; t++) {
+        jobs[t] = (AggregateJob){ds, sel, group, ops, num_ops, tables, num_blocks, num_threads, t, 0};
+    }
+    int started = 1;
+    while (started < num_threads && pthread_create(&threads[started], NULL, aggregate_worker, &jobs[started]) == 0) {
+        started++;
+    }
+    // Blocks of threads that could not be started are picked up here
+    for (int t=started; t<num_threads; t++) {
+        aggregate_worker(&jobs[t]);
+    }
+    aggregate_worker(&jobs[0]);
+    int failed = jobs[0].failed;
+    for (int t=1; t<num_threads; t++) {
+        if (t < started) pthread_join(threads[t], NULL);
+        failed |= jobs[t].failed;
+    }
+
+    // Fold blocks in order; block 0 already holds the first partial sums
+    if (!failed) {
+        *table = tables[0];
+        tables[0] = (GroupTable){0};
+    }
+    for (int b=1; !failed && b<num_blocks; b++) {
+        failed = group_table_merge(table, &tables[b], key) < 0;
+    }
+    for (int b=0; b<num_blocks; b++) {
+        group_table_free(&tables[b]);
+    }
+    free(tables);
+    if (failed) {
+        group_table_free(table);
+        memset(table, 0, sizeof(*table));
+        return -1;
+    }
+    return 0;
+}
+
+/* Bucket bounds in the shortest %g form, at least the default six digits,
+ * that reads both back as the same floats; widths and values are floats,
+ * so neighbouring buckets never print alike. Each buffer holds 32 bytes. */
+static void format_bounds(char *lo_text, char *hi_text, double lo, double hi) {
+    for (int precision=6; precision<=9; precision++) {
+        snprintf(lo_text, 32, "%.*g", precision, lo);
+        snprintf(hi_text, 32, "%.*g", precision, hi);
+        if (strtof(lo_text, NULL) == (float)lo && strtof(hi_text, NULL) == (float)hi) return;
+    }
+}
+
+/* population-total, population:<field> and percent:<field> for a run of
+ * consecutive aggregate ops, one block of results per group under group-by */
+static void op_aggregates(const Dataset *ds, const Selection *sel, const GroupKey *group,
+                          const char *group_name, const Operation *ops, int num_ops, Output *o) {
+    const Column *key = group ? group->column : NULL;
+    GroupTable table;
+    if (aggregate_totals(ds, sel, group, ops, num_ops, &table) < 0) goto out_of_memory;
+
+    if (!key) {
+        print_aggregates(o, ops, num_ops, table.groups[0].total_pop, table.sums, table.missing);
+        group_table_free(&table);
+        return;
+    }
+
+    GroupTotals **order = malloc(sizeof(GroupTotals*)*(table.count ? table.count : 1));
+    if (!order) {
+        group_table_free(&table);
+        goto out_of_memory;
+    }
+    int num_groups = 0;
+    for (int g=0; g<table.count; g++) {
+        if (table.groups[g].count) order[num_groups++] = &table.groups[g];
+    }
+    qsort_r(order, num_groups, sizeof(GroupTotals*), compare_groups, key->dict.strings);
+    for (int n=0; n<num_groups; n++) {
+        const GroupTotals *gt = order[n];
+        char lo[32], hi[32];
+        if (gt->code < 0) format_bounds(lo, hi, gt->bucket*group->width, (gt->bucket + 1)*group->width);
+        if (o->format == FORMAT_JSONL) {
+            output_status(o, "group");
+            output_status_text(o, "field", group_name);
+            if (gt->code >= 0) {
+                output_status_text(o, "value", key->dict.strings[gt->code]);
+            } else {
+                output_printf(o, ",\"from\":%s,\"to\":%s", lo, hi);
+            }
+            output_printf(o, ",\"entries\":%d}\n", gt->count);
+        } else if (gt->code >= 0) {
+            output_printf(o, "Group: %s = %s (%d entries)\n", group_name, key->dict.strings[gt->code], gt->count);
+        } else {
+            output_printf(o, "Group: %s = [%s, %s) (%d entries)\n", group_name, lo, hi, gt->count);
+        }
+        size_t g = (size_t)(gt - table.groups)*num_ops;
+        print_aggregates(o, ops, num_ops, gt->total_pop, table.sums + g, table.missing + g);
+    }
+    free(order);
+    group_table_free(&table);
+    return;
+
+out_of_memory:
+    output_error(o, "Error: Out of memory.\n");
+}
+
+static inline int sketch_bin(double magnitude) {
+    int bin = (int)ceil(log(magnitude / SKETCH_MIN_VALUE) / log(SKETCH_GAMMA));
+    return bin < 0 ? 0 : bin >= SKETCH_BINS ? SKETCH_BINS-1 : bin;
+}
+
+/* Midpoint (in relative terms) of the values counted in a bin */
+static double sketch_bin_value(int bin) {
+    return SKETCH_MIN_VALUE * pow(SKETCH_GAMMA, bin) * 2.0 / (SKETCH_GAMMA + 1.0);
+}
+
+static void sketch_add(QuantileSketch *sk, float v, int weight) {
+    if (v != v) return;
+    if (sk->count == 0 || v < sk->min) sk->min = v;
+    if (sk->count == 0 || v > sk->max) sk->max = v;
+    sk->count++;
+    sk->total += weight;
+    if (fabsf(v) < SKETCH_MIN_VALUE) {
+        sk->zero += weight;
+    } else if (v > 0.0f) {
+        sk->positive[sketch_bin(v)] += weight;
+    } else {
+        sk->negative[sketch_bin(-v)] += weight;
+    }
+}
+
+/* Counts are whole numbers, so merging in any order gives the same sketch */
+static void sketch_merge(QuantileSketch *dst, const QuantileSketch *src) {
+    if (src->count == 0) return;
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (dst->count == 0 || src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->total += src->total;
+    dst->zero += src->zero;
+    for (int b=0; b<SKETCH_BINS; b++) {
+        dst->positive[b] += src->positive[b];
+        dst->negative[b] += src->negative[b];
+    }
+}
+
+/* Bins in value order: call with *at = 0 and repeat while the result is
+ * not negative. Returns the weight of the next non-empty bin and sets its
+ * value, clamped to the exact min and max. */
+static long long sketch_next(const QuantileSketch *sk, int *at, double *value) {
+    while (*at <= 2*SKETCH_BINS) {
+        int k = (*at)++;
+        long long weight;
+        if (k < SKETCH_BINS) {
+            weight = sk->negative[SKETCH_BINS-1 - k];
+            *value = -sketch_bin_value(SKETCH_BINS-1 - k);
+        } else if (k == SKETCH_BINS) {
+            weight = sk->zero;
+            *value = 0.0;
+        } else {
+            weight = sk->positive[k - SKETCH_BINS - 1];
+            *value = sketch_bin_value(k - SKETCH_BINS - 1);
+        }
+        if (!weight) continue;
+        if (*value < sk->min) *value = sk->min;
+        if (*value > sk->max) *value = sk->max;
+        return weight;
+    }
+    return -1;
+}
+
+/* One active row's value and weight, for exact quantiles */
+typedef struct {
+    float value;
+    int weight;
+} WeightedValue;
+
+/* Smallest value whose running weight, in value order, reaches target
+ * (0 < target <= total weight). Quickselect: expected linear time, and
+ * it only reorders a. */
+static float select_weighted(WeightedValue *a, int n, double target) {
+    int lo = 0, hi = n-1;
+    while (lo < hi) {
+        // Median of three as pivot; the three-way split keeps runs of equal values cheap
+        float x = a[lo].value, y = a[lo + (hi-lo)/2].value, z = a[hi].value;
+        float pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        int lt = lo, i = lo, gt = hi;
+        double below = 0.0, equal = 0.0;
+        while (i <= gt) {
+            WeightedValue t = a[i];
+            if (t.value < pivot) {
+                below += t.weight;
+                a[i++] = a[lt];
+                a[lt++] = t;
+            } else if (t.value > pivot) {
+                a[i] = a[gt];
+                a[gt--] = t;
+            } else {
+                equal += t.weight;
+                i++;
+            }
+        }
+        if (target <= below) {
+            hi = lt-1;
+        } else if (target <= below + equal) {
+            return pivot;
+        } else {
+            target -= below + equal;
+            lo = gt+1;
+        }
+    }
+    return a[lo < n ? lo : n-1].value;
+}
+
+/* Weight of a row for median:, quantile: and histogram: */
+static inline int row_weight(const Dataset *ds, const Operation *op, int i) {
+    return op->weighted ? ds->columns[ds->col_pop].i[i] : 1;
+}
+
+/* Sketch of one field over the active rows; thread t takes blocks t, t+n, ... */
+typedef struct {
+    const Dataset *ds;
+    const Selection *sel;
+    const Operation *op;
+    QuantileSketch *sketch;
+    int num_blocks;
+    int stride;
+    int first;
+} SketchJob;
+
+static void *sketch_worker(void *arg) {
+    SketchJob *job = arg;
+    const Selection *sel = job->sel;
+    for (int b=job->first; b<job->num_blocks; b+=job->stride) {
+        int end = (b + 1)*AGGREGATE_BLOCK_WORDS;
+        if (end > sel->num_words) end = sel->num_words;
+        for (int w=b*AGGREGATE_BLOCK_WORDS; w<end; w++) {
+            for (uint64_t word = sel->bits[w]; word; word &= word - 1) {
+                int i = w*64 + __builtin_ctzll(word);
+                sketch_add(job->sketch, column_value(job->op->column, i), row_weight(job->ds, job->op, i));
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Add the active rows to sk, on up to thread_count() threads */
+static int sketch_selection(const Dataset *ds, const Selection *sel, const Operation *op, QuantileSketch *sk) {
+    int num_blocks = (sel->num_words + AGGREGATE_BLOCK_WORDS - 1) / AGGREGATE_BLOCK_WORDS;
+    int num_threads = thread_count();
+    if (num_threads > num_blocks) num_threads = num_blocks;
+    if (num_threads < 1) num_threads = 1;
+    SketchJob jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started = 1, failed = 0;
+    for (int t=0; t<num_threads; t++) {
+        jobs[t] = (SketchJob){ds, sel, op, t ? calloc(1, sizeof(QuantileSketch)) : sk, num_blocks, num_threads, t};
+        if (!jobs[t].sketch) failed = 1;
+    }
+    while (!failed && started < num_threads && pthread_create(&threads[started], NULL, sketch_worker, &jobs[started]) == 0) {
+        started++;
+    }
+    for (int t=started; !failed && t<num_threads; t++) {
+        sketch_worker(&jobs[t]);
+    }
+    if (!failed) sketch_worker(&jobs[0]);
+    for (int t=1; t<num_threads; t++) {
+        if (t < started && !failed) pthread_join(threads[t], NULL);
+        if (!failed) sketch_merge(sk, jobs[t].sketch);
+        free(jobs[t].sketch);
+    }
+    return failed ? -1 : 0;
+}
+
+/* Print a median:, quantile: or histogram: result from the values of the
+ * active rows that have the field (exact) or from a sketch of them */
+static void print_distribution(Output *o, const Operation *op, WeightedValue *values, int n,
+                               const QuantileSketch *sk) {
+    long long entries = sk ? sk->count : n;
+    char flags[64];
+    snprintf(flags, sizeof(flags), "%s%s%lld entries", op->weighted ? "population-weighted, " : "",
+             op->approximate ? "approximate, " : "", entries);
+    double total = 0.0;
+    float lo = 0.0f, hi = 0.0f;
+    if (sk) {
+        total = (double)sk->total;
+        lo = sk->min;
+        hi = sk->max;
+    }
+    for (int k=0; k<n; k++) {
+        total += values[k].weight;
+        if (k == 0 || values[k].value < lo) lo = values[k].value;
+        if (k == 0 || values[k].value > hi) hi = values[k].value;
+    }
+
+    int json = o->format == FORMAT_JSONL;
+    if (json) {
+        output_status(o, op->kind == OP_HISTOGRAM ? "histogram" : op->quantile == 0.5 ? "median" : "quantile");
+        output_status_text(o, "field", op->name);
+        output_printf(o, ",\"entries\":%lld,\"weighted\":%s,\"approximate\":%s", entries,
+                      op->weighted ? "true" : "false", op->approximate ? "true" : "false");
+    }
+
+    if (op->kind == OP_QUANTILE) {
+        if (json) {
+            output_printf(o, ",\"quantile\":%g,\"value\":", op->quantile);
+        } else if (op->quantile == 0.5) {
+            output_printf(o, "Median %s: ", op->name);
+        } else {
+            output_printf(o, "Quantile %g %s: ", op->quantile, op->name);
+        }
+        if (!(total > 0.0)) {
+            if (json) {
+                output_str(o, "null}\n");
+            } else {
+                output_printf(o, "none (%s)\n", flags);
+            }
+            return;
+        }
+        // Integer weights: any target in (0, 1] picks the lowest weighted value
+        double target = op->quantile*total;
+        if (target < 0.5) target = 0.5;
+        double result = 0.0;
+        if (sk) {
+            double running = 0.0, value;
+            int at = 0;
+            for (long long weight; (weight = sketch_next(sk, &at, &value)) >= 0; ) {
+                result = value;
+                running += weight;
+                if (running >= target) break;
+            }
+        } else {
+            result = select_weighted(values, n, target);
+        }
+        if (json) {
+            output_printf(o, "%f}\n", result);
+        } else {
+            output_printf(o, "%f (%s)\n", result, flags);
+        }
+        return;
+    }
+
+    if (json) {
+        output_str(o, ",\"buckets\":[");
+    } else {
+        output_printf(o, "Histogram %s: %d buckets (%s)\n", op->name, op->buckets, flags);
+    }
+    if (!sk && n == 0) {
+        if (json) output_str(o, "]}\n");
+        return;
+    }
+    long long *counts = calloc(op->buckets, sizeof(long long));
+    if (!counts) {
+        output_error(o, "Error: Out of memory.\n");
+        return;
+    }
+    double width = ((double)hi - lo) / op->buckets;
+    int at = 0;
+    double value;
+    for (int k=0; ; k++) {
+        long long weight;
+        if (sk) {
+            if ((weight = sketch_next(sk, &at, &value)) < 0) break;
+        } else {
+            if (k == n) break;
+            weight = values[k].weight;
+            value = values[k].value;
+        }
+        int b = width > 0.0 ? (int)((value - lo) / width) : 0;
+        counts[b < 0 ? 0 : b >= op->buckets ? op->buckets-1 : b] += weight;
+    }
+    for (int b=0; b<op->buckets; b++) {
+        double from = lo + b*width, to = b == op->buckets-1 ? (double)hi : lo + (b+1)*width;
+        if (json) {
+            output_printf(o, "%s{\"from\":%g,\"to\":%g,\"count\":%lld}", b ? "," : "", from, to, counts[b]);
+        } else {
+            output_printf(o, "\t[%g, %g%c: %lld\n", from, to, b == op->buckets-1 ? ']' : ')', counts[b]);
+        }
+    }
+    if (json) output_str(o, "]}\n");
+    free(counts);
+}
+
+/* median:, quantile: and histogram: over the active rows. Exact results
+ * select from a copy of the field; approx ones read a sketch. */
+static void op_distribution(const Dataset *ds, const Selection *sel, const Operation *op, Output *o) {
+    int entries = selection_count(sel);
+    if (op->approximate) {
+        QuantileSketch *sk = calloc(1, sizeof(QuantileSketch));
+        if (!sk || sketch_selection(ds, sel, op, sk) < 0) {
+            free(sk);
+            output_error(o, "Error: Out of memory.\n");
+            return;
+        }
+        print_distribution(o, op, NULL, 0, sk);
+        free(sk);
+        return;
+    }
+
+    WeightedValue *values = malloc(sizeof(WeightedValue)*(entries ? entries : 1));
+    if (!values) {
+        output_error(o, "Error: Out of memory.\n");
+        return;
+    }
+    int n = 0;
+    for (int i=selection_next(sel, 0); i>=0; i=selection_next(sel, i+1)) {
+        float v = column_value(op->column, i);
+        if (v != v) continue;
+        values[n].value = v;
+        values[n++].weight = row_weight(ds, op, i);
+    }
+    print_distribution(o, op, values, n, NULL);
+    free(values);
+}
+
+/* Copy a field name or state code into the operation, rejecting overlong names */
+static int set_operation_name(Operation *op, const char *name, int line_num, FILE *err) {
+    if (strlen(name) >= sizeof(op->name)) {
+        fprintf(err, "Error: Name too long on line %d.\n", line_num);
+        return -1;
+    }
+    strcpy(op->name, name);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    Comparison cmp;
+} comparison_names[] = {
+    {"ge", CMP_GE}, {"le", CMP_LE}, {"gt", CMP_GT}, {"lt", CMP_LT}, {"eq", CMP_EQ}, {"ne", CMP_NE}
+};
+
+static const struct {
+    const char *name;
+    StringMatch match;
+} match_names[] = {
+    {"eq", MATCH_EQ}, {"ne", MATCH_NE}, {"in", MATCH_IN}, {"prefix", MATCH_PREFIX}, {"contains", MATCH_CONTAINS}
+};
+
+#define MAX_CLAUSE_VALUES 64
+
+static Predicate *new_predicate(PredicateKind kind, Predicate *left, Predicate *right) {
+    Predicate *p = calloc(1, sizeof(Predicate));
+    if (!p) {
+        free_predicate(left);
+        free_predicate(right);
+        return NULL;
+    }
+    p->kind = kind;
+    p->left = left;
+    p->right = right;
+    return p;
+}
+
+static Predicate *numeric_clause(ColumnRef col, Comparison cmp, float number) {
+    Predicate *p = new_predicate(PRED_NUMERIC, NULL, NULL);
+    if (p) {
+        p->column = col;
+        p->cmp = cmp;
+        p->number = number;
+    }
+    return p;
+}
+
+/* Compile '<field> <op> <values>' into a leaf, or into a small and/or tree for
+ * numeric 'between' and 'in'. Prints the error and returns NULL on failure. */
+static Predicate *build_clause(const Dataset *ds, const char *field, const char *op,
+                               char **values, int num_values, int line_num, FILE *err) {
+    int id = find_column(ds, field);
+    if (id < 0) {
+        fprintf(err, "Error: filter field '%s' not found on line %d.\n", field, line_num);
+        return NULL;
+    }
+    const Column *col = &ds->columns[id];
+    if (col->type == COL_UNKNOWN) {
+        // Only while streaming: no value seen yet to type the column by
+        fprintf(err, "Error: filter field '%s' has no values yet on line %d.\n", field, line_num);
+        return NULL;
+    }
+
+    int is_between = strcmp(op, "between") == 0;
+    int cmp = -1, match = -1;
+    for (size_t k=0; k<sizeof(comparison_names)/sizeof(comparison_names[0]); k++) {
+        if (strcmp(op, comparison_names[k].name) == 0) cmp = (int)comparison_names[k].cmp;
+    }
+    for (size_t k=0; k<sizeof(match_names)/sizeof(match_names[0]); k++) {
+        if (strcmp(op, match_names[k].name) == 0) match = (int)match_names[k].match;
+    }
+    if (cmp < 0 && match < 0 && !is_between) {
+        fprintf(err, "Error: filter comparison '%s' invalid on line %d.\n", op, line_num);
+        return NULL;
+    }
+    int wanted = is_between ? 2 : 1;
+    if (match == MATCH_IN ? num_values < 1 : num_values != wanted) {
+        fprintf(err, "Error: filter comparison '%s' takes %s on line %d.\n", op,
+                is_between ? "two values" : match == MATCH_IN ? "a list of values" : "one value", line_num);
+        return NULL;
+    }
+
+    if (is_numeric_column(col)) {
+        if (cmp < 0 && !is_between && match != MATCH_IN) {
+            fprintf(err, "Error: filter comparison '%s' needs a text field on line %d.\n", op, line_num);
+            return NULL;
+        }
+        float numbers[MAX_CLAUSE_VALUES];
+        for (int v=0; v<num_values; v++) {
+            if (convert_to_float(values[v], &numbers[v]) < 0) {
+                fprintf(err, "Error: filter number '%s' invalid on line %d.\n", values[v], line_num);
+                return NULL;
+            }
+        }
+        ColumnRef ref = resolve_column(ds, id);
+        if (is_between) {
+            Predicate *lo = numeric_clause(ref, CMP_GE, numbers[0]);
+            Predicate *hi = lo ? numeric_clause(ref, CMP_LE, numbers[1]) : NULL;
+            return hi ? new_predicate(PRED_AND, lo, hi) : (free_predicate(lo), NULL);
+        }
+        if (match == MATCH_IN) {
+            Predicate *tree = numeric_clause(ref, CMP_EQ, numbers[0]);
+            for (int v=1; tree && v<num_values; v++) {
+                Predicate *eq = numeric_clause(ref, CMP_EQ, numbers[v]);
+                tree = eq ? new_predicate(PRED_OR, tree, eq) : (free_predicate(tree), NULL);
+            }
+            return tree;
+        }
+        return numeric_clause(ref, (Comparison)cmp, numbers[0]);
+    }
+
+    if (match < 0) {
+        fprintf(err, "Error: filter field '%s' is not numeric.\n", field);
+        return NULL;
+    }
+    Predicate *p = new_predicate(col->type == COL_INTERNED ? PRED_CODES : PRED_STRING, NULL, NULL);
+    if (!p) return NULL;
+    p->match = (StringMatch)match;
+    if (col->type == COL_INTERNED) {
+        // Match each distinct value once; rows then only look up their id
+        p->codes = col->codes;
+        p->code_rows = col->order;
+        p->code_start = col->code_start;
+        p->num_codes = col->dict.count;
+        p->code_match = calloc(col->dict.count ? col->dict.count : 1, 1);
+        if (!p->code_match) {
+            free_predicate(p);
+            return NULL;
+        }
+        for (int j=0; j<col->dict.count; j++) {
+            p->code_match[j] = (unsigned char)string_matches(col->dict.strings[j], p->match, values, num_values);
+        }
+        return p;
+    }
+    p->strings = col->s;
+    p->values = calloc(num_values, sizeof(char*));
+    if (!p->values) {
+        free_predicate(p);
+        return NULL;
+    }
+    for (int v=0; v<num_values; v++) {
+        p->values[v] = strdup(values[v]);
+        if (!p->values[v]) {
+            free_predicate(p);
+            return NULL;
+        }
+        p->num_values++;
+    }
+    return p;
+}
+
+/* Recursive-descent parser for where: expressions.
+ *   expr   := term { "or" term }
+ *   term   := factor { "and" factor }
+ *   factor := "not" factor | "(" expr ")" | field op value { "," value }
+ * Field names with spaces go in [brackets]; values may be "quoted". */
+typedef enum {
+    TOK_END,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_COMMA,
+    TOK_WORD,       // bare word; may be a keyword
+    TOK_QUOTED      // [field] or "value"; never a keyword
+} TokenKind;
+
+typedef struct {
+    const char *p;
+    const Dataset *ds;
+    int line_num;
+    FILE *err;
+    char text[256];     // text of the last token read
+    int error;
+} ExprParser;
+
+static TokenKind next_token(ExprParser *ps) {
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+    char c = *ps->p;
+    ps->text[0] = '\0';
+    if (c == '\0') return TOK_END;
+    if (c == '(' || c == ')' || c == ',') {
+        ps->p++;
+        return c == '(' ? TOK_LPAREN : c == ')' ? TOK_RPAREN : TOK_COMMA;
+    }
+
+    size_t n = 0;
+    TokenKind kind = TOK_WORD;
+    if (c == '[' || c == '"') {
+        char close = (c == '[') ? ']' : '"';
+        ps->p++;
+        while (*ps->p && *ps->p != close) {
+            if (n+1 < sizeof(ps->text)) ps->text[n++] = *ps->p;
+            ps->p++;
+        }
+        if (*ps->p != close) ps->error = 1;
+        else ps->p++;
+        kind = TOK_QUOTED;
+    } else {
+        while (*ps->p && !isspace((unsigned char)*ps->p) && !strchr("(),[]\"", *ps->p)) {
+            if (n+1 < sizeof(ps->text)) ps->text[n++] = *ps->p;
+            ps->p++;
+        }
+    }
+    ps->text[n] = '\0';
+    return kind;
+}
+
+static int peek_keyword(ExprParser *ps, const char *keyword) {
+    ExprParser save = *ps;
+    int hit = next_token(ps) == TOK_WORD && strcmp(ps->text, keyword) == 0;
+    if (!hit) *ps = save;
+    return hit;
+}
+
+static Predicate *parse_or(ExprParser *ps);
+
+static Predicate *parse_factor(ExprParser *ps) {
+    if (peek_keyword(ps, "not")) {
+        Predicate *inner = parse_factor(ps);
+        return inner ? new_predicate(PRED_NOT, inner, NULL) : NULL;
+    }
+
+    ExprParser save = *ps;
+    if (next_token(ps) == TOK_LPAREN) {
+        Predicate *inner = parse_or(ps);
+        if (inner && next_token(ps) != TOK_RPAREN) {
+            fprintf(ps->err, "Error: Malformed where expression on line %d: missing ')'.\n", ps->line_num);
+            free_predicate(inner);
+            return NULL;
+        }
+        return inner;
+    }
+    *ps = save;
+
+    char field[256], op[32];
+    TokenKind kind = next_token(ps);
+    strcpy(field, ps->text);
+    TokenKind op_kind = (kind == TOK_WORD || kind == TOK_QUOTED) ? next_token(ps) : TOK_END;
+    if (op_kind != TOK_WORD || strlen(ps->text) >= sizeof(op)) {
+        fprintf(ps->err, "Error: Malformed where expression on line %d: expected <field> <op> <value>.\n", ps->line_num);
+        return NULL;
+    }
+    strcpy(op, ps->text);
+
+    // between takes two values; in takes a comma-separated list
+    char *values[MAX_CLAUSE_VALUES];
+    int num_values = 0;
+    int is_between = strcmp(op, "between") == 0;
+    Predicate *result = NULL;
+    for (;;) {
+        kind = next_token(ps);
+        if (kind != TOK_WORD && kind != TOK_QUOTED) {
+            fprintf(ps->err, "Error: Malformed where expression on line %d: expected a value after '%s'.\n", ps->line_num, op);
+            goto done;
+        }
+        if (num_values == MAX_CLAUSE_VALUES) {
+            fprintf(ps->err, "Error: Too many values after '%s' on line %d.\n", op, ps->line_num);
+            goto done;
+        }
+        values[num_values] = strdup(ps->text);
+        if (!values[num_values]) goto done;
+        num_values++;
+        if (is_between && num_values < 2) {
+            peek_keyword(ps, "and");
+            continue;
+        }
+        save = *ps;
+        if (is_between || next_token(ps) != TOK_COMMA) {
+            *ps = save;
+            break;
+        }
+    }
+    result = build_clause(ps->ds, field, op, values, num_values, ps->line_num, ps->err);
+
+done:
+    for (int v=0; v<num_values; v++) {
+        free(values[v]);
+    }
+    return result;
+}
+
+static Predicate *parse_and(ExprParser *ps) {
+    Predicate *left = parse_factor(ps);
+    while (left && peek_keyword(ps, "and")) {
+        Predicate *right = parse_factor(ps);
+        left = right ? new_predicate(PRED_AND, left, right) : (free_predicate(left), NULL);
+    }
+    return left;
+}
+
+static Predicate *parse_or(ExprParser *ps) {
+    Predicate *left = parse_and(ps);
+    while (left && peek_keyword(ps, "or")) {
+        Predicate *right = parse_and(ps);
+        left = right ? new_predicate(PRED_OR, left, right) : (free_predicate(left), NULL);
+    }
+    return left;
+}
+
+static Predicate *compile_where(const Dataset *ds, const char *text, int line_num, FILE *err) {
+    ExprParser ps = {text, ds, line_num, err, "", 0};
+    Predicate *pred = parse_or(&ps);
+    if (pred && next_token(&ps) != TOK_END) {
+        fprintf(err, "Error: Malformed where expression on line %d: unexpected '%s'.\n", line_num, ps.text);
+        free_predicate(pred);
+        return NULL;
+    }
+    if (pred && ps.error) {
+        fprintf(err, "Error: Malformed where expression on line %d: unterminated quote.\n", line_num);
+        free_predicate(pred);
+        return NULL;
+    }
+    return pred;
+}
+
+static void free_operation(Operation *op) {
+    free_predicate(op->pred);
+    free(op->label);
+    free(op->fields);
+    op->pred = NULL;
+    op->label = NULL;
+    op->fields = NULL;
+}
+
+/* Resolve display:<field>,<field>,... into column ids. Field names may
+ * themselves contain commas, so the longest run of pieces naming a
+ * column wins. */
+static int parse_field_list(const Dataset *ds, const char *text, Operation *out, int line_num, FILE *err) {
+    char list[1024];
+    strcpy(list, text);
+    char *pieces[MAX_CLAUSE_VALUES];
+    int num_pieces = 0;
+    char *save;
+    for (char *f = strtok_r(list, ",", &save); f; f = strtok_r(NULL, ",", &save)) {
+        if (num_pieces == MAX_CLAUSE_VALUES) {
+            fprintf(err, "Error: Too many display fields on line %d.\n", line_num);
+            return -1;
+        }
+        pieces[num_pieces++] = f;
+    }
+
+    out->fields = malloc(sizeof(int)*(num_pieces ? num_pieces : 1));
+    if (!out->fields) {
+        fprintf(err, "Error: Out of memory.\n");
+        return -1;
+    }
+    for (int first=0; first<num_pieces; ) {
+        char name[1024];
+        int id = -1, last;
+        for (last=num_pieces-1; last>=first; last--) {
+            name[0] = '\0';
+            for (int k=first; k<=last; k++) {
+                if (k > first) strcat(name, ",");
+                strcat(name, pieces[k]);
+            }
+            if ((id = find_column(ds, name)) >= 0) break;
+        }
+        if (id < 0) {
+            fprintf(err, "Error: display field '%s' not found on line %d.\n", pieces[first], line_num);
+            free_operation(out);
+            return -1;
+        }
+        out->fields[out->num_fields++] = id;
+        first = last + 1;
+    }
+    return 0;
+}
+
+/* Compile one ops line, reporting problems on err.
+ * Returns 0 on success, 1 for a blank line, -1 on error */
+static int compile_operation(char *line, int line_num, const Dataset *ds, Operation *out, FILE *err) {
+    char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0') {
+        return 1; // blank line
+    }
+
+    char op_line[1024];
+    strcpy(op_line, p);
+    // Remove trailing whitespace
+    for (int i=(int)strlen(op_line)-1; i>=0 && isspace((unsigned char)op_line[i]); i--) {
+        op_line[i] = '\0';
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->line_num = line_num;
+    char full_line[1024];
+    strcpy(full_line, op_line);
+    char *colon = strchr(full_line, ':');
+    const char *rest = colon ? colon + 1 : "";
+    char *saveptr;
+    char *op = strtok_r(op_line, ":", &saveptr);
+    if (!op) {
+        fprintf(err, "Error: Malformed operation line %d\n", line_num);
+        return -1;
+    }
+
+    if (strcmp(op, "display") == 0) {
+        out->kind = OP_DISPLAY;
+        if (*rest && parse_field_list(ds, rest, out, line_num, err) < 0) return -1;
+    } else if (strcmp(op, "top") == 0 || strcmp(op, "sort") == 0) {
+        int is_top = strcmp(op, "top") == 0;
+        char *limit = is_top ? strtok_r(NULL, ":", &saveptr) : NULL;
+        char *field = strtok_r(NULL, ":", &saveptr);
+        char *dir = strtok_r(NULL, ":", &saveptr);
+        if (!field || (is_top && !dir)) {
+            fprintf(err, "Error: Malformed %s operation at line %d: expected %s.\n", op, line_num,
+                    is_top ? "top:<N>:<field>:asc|desc" : "sort:<field>[:asc|desc]");
+            return -1;
+        }
+        if (is_top && (convert_to_int(limit, &out->limit) < 0 || out->limit < 0)) {
+            fprintf(err, "Error: top count '%s' invalid on line %d.\n", limit, line_num);
+            return -1;
+        }
+        if (dir && strcmp(dir, "asc") != 0 && strcmp(dir, "desc") != 0) {
+            fprintf(err, "Error: %s order '%s' invalid on line %d.\n", op, dir, line_num);
+            return -1;
+        }
+        int id = find_column(ds, field);
+        if (id < 0 || !is_numeric_column(&ds->columns[id])) {
+            fprintf(err, "Error: %s field '%s' not supported.\n", op, field);
+            return -1;
+        }
+        out->kind = is_top ? OP_TOP : OP_SORT;
+        out->descending = dir && strcmp(dir, "desc") == 0;
+        if (set_operation_name(out, field, line_num, err) < 0) return -1;
+        out->column = resolve_column(ds, id);
+    } else if (strcmp(op, "filter-state") == 0) {
+        char *state = strtok_r(NULL, ":", &saveptr);
+        if (!state) {
+            fprintf(err, "Error: Malformed operation line %d: filter-state requires a state code.\n", line_num);
+            return -1;
+        }
+        char *values[1] = {state};
+        out->kind = OP_FILTER;
+        out->pred = build_clause(ds, "State", "eq", values, 1, line_num, err);
+        if (!out->pred || asprintf(&out->label, "state == %s", state) < 0) {
+            out->label = NULL;
+            free_operation(out);
+            return -1;
+        }
+    } else if (strcmp(op, "filter") == 0) {
+        char *field = strtok_r(NULL, ":", &saveptr);
+        char *cmp = strtok_r(NULL, ":", &saveptr);
+        char *arg = strtok_r(NULL, ":", &saveptr);
+        char *arg2 = strtok_r(NULL, ":", &saveptr);
+        if (!field || !cmp || !arg) {
+            fprintf(err, "Error: Malformed operation line %d: filter requires field:op:value.\n", line_num);
+            return -1;
+        }
+
+        // between takes lo:hi; in takes a comma-separated list
+        char *values[MAX_CLAUSE_VALUES];
+        int num_values = 0;
+        values[num_values++] = arg;
+        if (strcmp(cmp, "between") == 0) {
+            if (arg2) values[num_values++] = arg2;
+        } else if (strcmp(cmp, "in") == 0) {
+            char *list_save;
+            num_values = 0;
+            for (char *v = strtok_r(arg, ",", &list_save); v; v = strtok_r(NULL, ",", &list_save)) {
+                if (num_values == MAX_CLAUSE_VALUES) {
+                    fprintf(err, "Error: Too many filter values on line %d.\n", line_num);
+                    return -1;
+                }
+                values[num_values++] = v;
+            }
+        }
+        out->kind = OP_FILTER;
+        out->pred = build_clause(ds, field, cmp, values, num_values, line_num, err);
+        if (!out->pred) return -1;
+
+        int status;
+        if (out->pred->kind == PRED_NUMERIC) {
+            status = asprintf(&out->label, "%s %s %f", field, cmp, out->pred->number);
+        } else if (out->pred->kind == PRED_AND) {
+            status = asprintf(&out->label, "%s between %f %f", field, out->pred->left->number, out->pred->right->number);
+        } else {
+            char list[1024] = "";
+            for (int v=0; v<num_values; v++) {
+                if (v) strcat(list, ",");
+                strcat(list, values[v]);
+            }
+            status = asprintf(&out->label, "%s %s %s", field, cmp, list);
+        }
+        if (status < 0) {
+            out->label = NULL;
+            free_operation(out);
+            return -1;
+        }
+    } else if (strcmp(op, "where") == 0) {
+        out->kind = OP_FILTER;
+        out->pred = compile_where(ds, rest, line_num, err);
+        out->label = strdup(rest);
+        if (!out->pred || !out->label) {
+            free_operation(out);
+            return -1;
+        }
+    } else if (strcmp(op, "push") == 0) {
+        out->kind = OP_PUSH;
+    } else if (strcmp(op, "pop") == 0) {
+        out->kind = OP_POP;
+    } else if (strcmp(op, "reset") == 0) {
+        out->kind = OP_RESET;
+    } else if (strcmp(op, "save") == 0 || strcmp(op, "restore") == 0) {
+        char *name = strtok_r(NULL, ":", &saveptr);
+        if (!name) {
+            fprintf(err, "Error: Malformed %s operation at line %d: a selection name is required.\n", op, line_num);
+            return -1;
+        }
+        out->kind = strcmp(op, "save") == 0 ? OP_SAVE : OP_RESTORE;
+        if (set_operation_name(out, name, line_num, err) < 0) return -1;
+    } else if (strcmp(op, "group-by") == 0) {
+        char *field = strtok_r(NULL, ":", &saveptr);
+        char *width = strtok_r(NULL, ":", &saveptr);
+        if (!field) {
+            fprintf(err, "Error: Malformed group-by operation at line %d.\n", line_num);
+            return -1;
+        }
+        int id = find_column(ds, field);
+        if (id < 0 || (ds->columns[id].type != COL_INTERNED && !is_numeric_column(&ds->columns[id]))) {
+            fprintf(err, "Error: group-by field '%s' not supported.\n", field);
+            return -1;
+        }
+        out->kind = OP_GROUP_BY;
+        if (set_operation_name(out, field, line_num, err) < 0) return -1;
+        out->group.column = &ds->columns[id];
+        out->group.width = 1.0;
+        if (width && !is_numeric_column(&ds->columns[id])) {
+            fprintf(err, "Error: group-by width needs a numeric field on line %d.\n", line_num);
+            return -1;
+        }
+        if (is_numeric_column(&ds->columns[id])) {
+            out->group.values = resolve_column(ds, id);
+            float w;
+            if (width && (convert_to_float(width, &w) < 0 || !(w > 0.0f))) {
+                fprintf(err, "Error: group-by width '%s' invalid on line %d.\n", width, line_num);
+                return -1;
+            }
+            if (width) out->group.width = w;
+        }
+    } else if (strcmp(op, "ungroup") == 0) {
+        out->kind = OP_GROUP_BY;
+    } else if (strcmp(op, "population-total") == 0) {
+        out->kind = OP_POPULATION_TOTAL;
+    } else if (strcmp(op, "population") == 0 || strcmp(op, "percent") == 0) {
+        int is_percent = (strcmp(op, "percent") == 0);
+        char *field = strtok_r(NULL, ":", &saveptr);
+        if (!field) {
+            fprintf(err, "Error: Malformed %s operation at line %d.\n", op, line_num);
+            return -1;
+        }
+        int id = find_column(ds, field);
+        if (id < 0 || !is_numeric_column(&ds->columns[id])) {
+            fprintf(err, "Error: %s field '%s' not supported.\n", op, field);
+            return -1;
+        }
+        out->kind = is_percent ? OP_PERCENT : OP_POPULATION_SUB;
+        if (set_operation_name(out, field, line_num, err) < 0) return -1;
+        out->column = resolve_column(ds, id);
+    } else if (strcmp(op, "median") == 0 || strcmp(op, "quantile") == 0 || strcmp(op, "histogram") == 0) {
+        int is_median = strcmp(op, "median") == 0;
+        int is_histogram = strcmp(op, "histogram") == 0;
+        char *field = strtok_r(NULL, ":", &saveptr);
+        char *arg = is_median ? NULL : strtok_r(NULL, ":", &saveptr);
+        if (!field || (!is_median && !arg)) {
+            fprintf(err, "Error: Malformed %s operation at line %d: expected %s.\n", op, line_num,
+                    is_median ? "median:<field>" : is_histogram ? "histogram:<field>:<buckets>" : "quantile:<field>:<p>");
+            return -1;
+        }
+        int id = find_column(ds, field);
+        if (id < 0 || !is_numeric_column(&ds->columns[id])) {
+            fprintf(err, "Error: %s field '%s' not supported.\n", op, field);
+            return -1;
+        }
+        out->kind = is_histogram ? OP_HISTOGRAM : OP_QUANTILE;
+        out->quantile = 0.5;
+        float q;
+        if (is_histogram && (convert_to_int(arg, &out->buckets) < 0 || out->buckets < 1 || out->buckets > MAX_HISTOGRAM_BUCKETS)) {
+            fprintf(err, "Error: histogram bucket count '%s' invalid on line %d.\n", arg, line_num);
+            return -1;
+        }
+        if (!is_median && !is_histogram) {
+            if (convert_to_float(arg, &q) < 0 || !(q >= 0.0f && q <= 1.0f)) {
+                fprintf(err, "Error: quantile '%s' invalid on line %d: expected 0 to 1.\n", arg, line_num);
+                return -1;
+            }
+            out->quantile = atof(arg);
+        }
+        // Trailing options: weighted and approx, in any order
+        for (char *opt = strtok_r(NULL, ":", &saveptr); opt; opt = strtok_r(NULL, ":", &saveptr)) {
+            if (strcmp(opt, "weighted") == 0) {
+                out->weighted = 1;
+            } else if (strcmp(opt, "approx") == 0) {
+                out->approximate = 1;
+            } else {
+                fprintf(err, "Error: %s option '%s' invalid on line %d.\n", op, opt, line_num);
+                return -1;
+            }
+        }
+        if (set_operation_name(out, field, line_num, err) < 0) return -1;
+        out->column = resolve_column(ds, id);
+    } else {
+        fprintf(err, "Error: Unrecognized operation '%s' on line %d.\n", op, line_num);
+        return -1;
+    }
+    return 0;
+}
+
+/* push, pop, save:<name>, restore:<name> and reset: bitmap snapshots of the selection */
+static void op_scope(QueryState *qs, const Operation *op) {
+    Output *o = qs->out;
+    switch (op->kind) {
+    case OP_PUSH:
+        if (qs->depth >= qs->stack_capacity) {
+            int capacity = qs->stack_capacity ? qs->stack_capacity*2 : 8;
+            Selection *p = realloc(qs->stack, sizeof(Selection)*capacity);
+            if (!p) break;
+            qs->stack = p;
+            qs->stack_capacity = capacity;
+        }
+        if (selection_copy(&qs->stack[qs->depth], &qs->sel) == 0) {
+            qs->depth++;
+            return;
+        }
+        break;
+    case OP_POP:
+        if (qs->depth == 0) {
+            output_error(o, "Error: pop without a matching push on line %d.\n", op->line_num);
+            return;
+        }
+        selection_free(&qs->sel);
+        qs->sel = qs->stack[--qs->depth];
+        output_scope_status(o, "pop", NULL, selection_count(&qs->sel));
+        return;
+    case OP_SAVE: {
+        int id = dict_find(&qs->saved_names, op->name);
+        Selection copy;
+        if (selection_copy(&copy, &qs->sel) < 0) break;
+        if (id >= 0) {
+            selection_free(&qs->saved[id]);
+            qs->saved[id] = copy;
+            return;
+        }
+        if (qs->saved_names.count >= qs->saved_names.capacity) {
+            // Keep saved[] as large as the name table will be after interning
+            int capacity = qs->saved_names.capacity ? qs->saved_names.capacity*2 : 32;
+            Selection *p = realloc(qs->saved, sizeof(Selection)*capacity);
+            if (!p) {
+                selection_free(&copy);
+                break;
+            }
+            qs->saved = p;
+        }
+        id = dict_intern(&qs->saved_names, op->name);
+        if (id < 0) {
+            selection_free(&copy);
+            break;
+        }
+        qs->saved[id] = copy;
+        return;
+    }
+    case OP_RESTORE: {
+        int id = dict_find(&qs->saved_names, op->name);
+        if (id < 0) {
+            output_error(o, "Error: No saved selection '%s' on line %d.\n", op->name, op->line_num);
+            return;
+        }
+        memcpy(qs->sel.bits, qs->saved[id].bits, sizeof(uint64_t)*qs->sel.num_words);
+        output_scope_status(o, "restore", op->name, selection_count(&qs->sel));
+        return;
+    }
+    case OP_RESET: {
+        int count = qs->sel.count;
+        selection_free(&qs->sel);
+        if (selection_init(&qs->sel, count) < 0) break;
+        output_scope_status(o, "reset", NULL, count);
+        return;
+    }
+    default:
+        return;
+    }
+    output_error(o, "Error: Out of memory.\n");
+}
+
+static void execute_operation(const Operation *op, const Dataset *ds, QueryState *qs) {
+    switch (op->kind) {
+    case OP_DISPLAY:
+        op_display(ds, &qs->sel, op, qs->out);
+        break;
+    case OP_TOP:
+    case OP_SORT:
+        op_ordered(ds, &qs->sel, op, qs->out);
+        break;
+    case OP_FILTER:
+        op_filter(&qs->sel, op, qs->out);
+        break;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_SAVE:
+    case OP_RESTORE:
+    case OP_RESET:
+        op_scope(qs, op);
+        break;
+    case OP_GROUP_BY:
+        qs->group = op->group;
+        strcpy(qs->group_name, op->name);
+        break;
+    case OP_POPULATION_TOTAL:
+    case OP_POPULATION_SUB:
+    case OP_PERCENT:
+        op_aggregates(ds, &qs->sel, &qs->group, qs->group_name, op, 1, qs->out);
+        break;
+    case OP_QUANTILE:
+    case OP_HISTOGRAM:
+        op_distribution(ds, &qs->sel, op, qs->out);
+        break;
+    }
+    output_flush(qs->out);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static long long heap_in_use(void) {
+    struct mallinfo2 mi = mallinfo2();
+    return (long long)(mi.uordblks + mi.hblkhd);
+}
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
+
+/* Start a step; text is cut at the end of its line. NULL when out of memory. */
+static ProfileStep *profile_begin(Profile *p, const char *text, int line_num, long long rows, const Output *o) {
+    if (p->count == p->capacity) {
+        int capacity = p->capacity ? p->capacity*2 : 32;
+        ProfileStep *steps = realloc(p->steps, sizeof(ProfileStep)*capacity);
+        if (!steps) return NULL;
+        p->steps = steps;
+        p->capacity = capacity;
+    }
+    ProfileStep *step = &p->steps[p->count++];
+    memset(step, 0, sizeof(*step));
+    while (isspace((unsigned char)*text)) text++;
+    snprintf(step->text, sizeof(step->text), "%.*s", (int)strcspn(text, "\r\n"), text);
+    step->first_line = step->last_line = line_num;
+    step->rows_scanned = rows;
+    step->bytes_written = o ? o->written + (long long)o->len : 0;
+    step->heap_change = heap_in_use();
+    step->seconds = now_seconds();
+    return step;
+}
+
+static void profile_end(ProfileStep *step, long long rows, long long bytes_read, const Output *o) {
+    if (!step) return;
+    step->seconds = now_seconds() - step->seconds;
+    step->heap_change = heap_in_use() - step->heap_change;
+    step->bytes_written = o ? o->written + (long long)o->len - step->bytes_written : 0;
+    step->rows_selected = rows;
+    step->bytes_read = bytes_read;
+    step->peak_rss_kb = peak_rss_kb();
+}
+
+/* Bytes per row of a column's value array */
+static int column_width(const Column *c) {
+    switch (c->type) {
+    case COL_STRING:
+        return sizeof(char *);
+    case COL_FLOAT:
+        return sizeof(float);
+    default:
+        return sizeof(int);
+    }
+}
+
+static long long predicate_row_bytes(const Predicate *p) {
+    switch (p->kind) {
+    case PRED_AND:
+    case PRED_OR:
+        return predicate_row_bytes(p->left) + predicate_row_bytes(p->right);
+    case PRED_NOT:
+        return predicate_row_bytes(p->left);
+    case PRED_NUMERIC:
+        return p->column.f ? sizeof(float) : sizeof(int);
+    case PRED_CODES:
+        return sizeof(int);
+    case PRED_STRING:
+        return sizeof(char *);
+    }
+    return 0;
+}
+
+/* Column bytes an op reads over 'rows' active rows; scope ops copy bitmaps */
+static long long operation_bytes(const Dataset *ds, const QueryState *qs, const Operation *ops, int num_ops,
+                                 long long rows) {
+    long long row_bytes = 0;
+    switch (ops[0].kind) {
+    case OP_DISPLAY:
+        if (ops[0].fields) {
+            for (int k=0; k<ops[0].num_fields; k++) row_bytes += column_width(&ds->columns[ops[0].fields[k]]);
+        } else {
+            for (int k=0; k<NUM_DISPLAY_FIELDS; k++) {
+                int id = find_column(ds, display_fields[k]);
+                if (id >= 0) row_bytes += column_width(&ds->columns[id]);
+            }
+        }
+        break;
+    case OP_TOP:
+    case OP_SORT:
+        row_bytes = ops[0].column.f ? sizeof(float) : sizeof(int);
+        break;
+    case OP_QUANTILE:
+    case OP_HISTOGRAM:
+        row_bytes = (ops[0].column.f ? sizeof(float) : sizeof(int)) + (ops[0].weighted ? sizeof(int) : 0);
+        break;
+    case OP_FILTER:
+        row_bytes = predicate_row_bytes(ops[0].pred);
+        break;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_SAVE:
+    case OP_RESTORE:
+    case OP_RESET:
+        return (long long)qs->sel.num_words * sizeof(uint64_t);
+    case OP_GROUP_BY:
+        return 0;
+    case OP_POPULATION_TOTAL:
+    case OP_POPULATION_SUB:
+    case OP_PERCENT:
+        // One pass reads the population, the group key and each op's field
+        row_bytes = sizeof(int) + (qs->group.column ? sizeof(int) : 0);
+        for (int k=0; k<num_ops; k++) {
+            if (ops[k].kind != OP_POPULATION_TOTAL) row_bytes += ops[k].column.f ? sizeof(float) : sizeof(int);
+        }
+        break;
+    }
+    return row_bytes * rows;
+}
+
+/* Run fused aggregate lines as one pass; text is the first line as written */
+static void run_aggregates(const Dataset *ds, QueryState *qs, const Operation *ops, int num_ops, const char *text) {
+    ProfileStep *step = NULL;
+    if (qs->profile) step = profile_begin(qs->profile, text, ops[0].line_num, selection_count(&qs->sel), qs->out);
+    op_aggregates(ds, &qs->sel, &qs->group, qs->group_name, ops, num_ops, qs->out);
+    output_flush(qs->out);
+    if (step) {
+        step->last_line = ops[num_ops-1].line_num;
+        profile_end(step, step->rows_scanned, operation_bytes(ds, qs, ops, num_ops, step->rows_scanned), qs->out);
+    }
+}
+
+/* Run each line in order, holding back runs of consecutive aggregate ops
+ * until something that changes or prints the selection comes along */
+static void run_operations(FILE *fp, const Dataset *ds, QueryState *qs) {
+    Operation pending[MAX_FUSED_OPS];
+    int num_pending = 0;
+    char pending_text[PROFILE_TEXT] = "";
+    char line[1024];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_num++;
+        Operation op;
+        // While aggregates are held back, messages wait for their results so output stays in line order
+        char *message = NULL;
+        size_t message_len = 0;
+        FILE *err = num_pending ? open_memstream(&message, &message_len) : NULL;
+        int status = compile_operation(line, line_num, ds, &op, err ? err : qs->out->err);
+        if (err) {
+            fclose(err);
+            if (message_len) {
+                run_aggregates(ds, qs, pending, num_pending, pending_text);
+                num_pending = 0;
+                output_error(qs->out, "%s", message);
+            }
+            free(message);
+        }
+        if (status == 1) continue;
+        if (status == 0 && is_aggregate(&op) && num_pending < MAX_FUSED_OPS) {
+            if (num_pending == 0) snprintf(pending_text, sizeof(pending_text), "%.*s", PROFILE_TEXT-1, line);
+            pending[num_pending++] = op;
+            continue;
+        }
+        if (num_pending) {
+            run_aggregates(ds, qs, pending, num_pending, pending_text);
+            num_pending = 0;
+        }
+        if (status == 0 && is_aggregate(&op)) {
+            snprintf(pending_text, sizeof(pending_text), "%.*s", PROFILE_TEXT-1, line);
+            pending[num_pending++] = op;
+        } else if (status == 0) {
+            ProfileStep *step = NULL;
+            if (qs->profile) step = profile_begin(qs->profile, line, line_num, selection_count(&qs->sel), qs->out);
+            execute_operation(&op, ds, qs);
+            if (step) {
+                profile_end(step, selection_count(&qs->sel), operation_bytes(ds, qs, &op, 1, step->rows_scanned), qs->out);
+            }
+            free_operation(&op);
+        }
+    }
+    if (num_pending) {
+        run_aggregates(ds, qs, pending, num_pending, pending_text);
+    }
+}
+
+/* --profile report on stderr: a table, or one JSON object per step followed
+ * by a summary object */
+static void print_profile(const Profile *p) {
+    double total = 0.0;
+    for (int k=0; k<p->count; k++) total += p->steps[k].seconds;
+    fflush(stdout);
+    if (p->json) {
+        static Output o;
+        o.fp = stderr;
+        o.err = stderr;
+        for (int k=0; k<p->count; k++) {
+            const ProfileStep *st = &p->steps[k];
+            output_str(&o, "{\"step\":");
+            output_json_string(&o, st->text);
+            output_printf(&o, ",\"first_line\":%d,\"last_line\":%d,\"seconds\":%.6f", st->first_line, st->last_line, st->seconds);
+            output_printf(&o, ",\"rows_scanned\":%lld,\"rows_selected\":%lld", st->rows_scanned, st->rows_selected);
+            output_printf(&o, ",\"bytes_read\":%lld,\"bytes_written\":%lld", st->bytes_read, st->bytes_written);
+            output_printf(&o, ",\"heap_change\":%lld,\"peak_rss_kb\":%ld}\n", st->heap_change, st->peak_rss_kb);
+        }
+        output_printf(&o, "{\"step\":\"total\",\"seconds\":%.6f,\"heap_in_use\":%lld,\"peak_rss_kb\":%ld}\n",
+                      total, heap_in_use(), peak_rss_kb());
+        output_flush(&o);
+        return;
+    }
+    fprintf(stderr, "%-5s %-32s %10s %10s %10s %10s %10s %10s\n",
+            "Line", "Step", "Seconds", "Scanned", "Selected", "Read KB", "Written KB", "Heap KB");
+    for (int k=0; k<p->count; k++) {
+        const ProfileStep *st = &p->steps[k];
+        char lines[24] = "-";
+        if (st->last_line > st->first_line) snprintf(lines, sizeof(lines), "%d-%d", st->first_line, st->last_line);
+        else if (st->first_line) snprintf(lines, sizeof(lines), "%d", st->first_line);
+        fprintf(stderr, "%-5s %-32.32s %10.6f %10lld %10lld %10lld %10lld %+10lld\n", lines, st->text, st->seconds,
+                st->rows_scanned, st->rows_selected, st->bytes_read/1024, st->bytes_written/1024, st->heap_change/1024);
+    }
+    fprintf(stderr, "Total %.6f s, heap in use %lld KB, peak RSS %ld KB\n", total, heap_in_use()/1024, peak_rss_kb());
+}
+
+static void process_operations(const char *filename, const Dataset *ds, QueryState *qs) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open operations file '%s'\n", filename);
+        return;
+    }
+    run_operations(fp, ds, qs);
+    fclose(fp);
+}
+
+/* --stream: rows parsed before the script runs over them. Equal to one
+ * aggregate block, so streamed totals match those of a full load exactly. */
+#define STREAM_CHUNK_ROWS (AGGREGATE_BLOCK_WORDS*64)
+
+/* One line of a streamed script and what it has produced so far */
+typedef struct {
+    char line[1024];
+    int line_num;
+    OpKind kind;
+    char name[256];         // aggregates: field name printed with the result
+    char *label;            // filters: label printed with the entry count
+    long long entries;      // filters: rows kept over all chunks
+    int run_length;         // first op of an aggregate run: ops in the run
+    int started;            // totals holds at least one chunk
+    GroupTable totals;      // first op of an aggregate run
+    QuantileSketch *sketch; // median:, quantile: and histogram:, always approximate here
+    Operation spec;         // those ops as first compiled, for printing
+    Operation op;           // compiled against the current chunk
+} StreamStep;
+
+static int is_streamable(const Operation *op) {
+    return op->kind == OP_FILTER || op->kind == OP_QUANTILE || op->kind == OP_HISTOGRAM || is_aggregate(op);
+}
+
+/* Run a chunk through the script: filters narrow the chunk's selection and
+ * each aggregate run adds the chunk's totals to its running totals */
+static int stream_chunk(const Dataset *ds, StreamStep *steps, int num_steps) {
+    Selection sel;
+    if (selection_init(&sel, ds->count) < 0) return -1;
+    int status = 0;
+    for (int k=0; k<num_steps && status == 0; k++) {
+        status = compile_operation(steps[k].line, steps[k].line_num, ds, &steps[k].op, stderr);
+    }
+    for (int k=0; k<num_steps && status == 0; ) {
+        StreamStep *step = &steps[k];
+        if (step->kind == OP_FILTER) {
+            Selection out;
+            status = selection_alloc(&out, sel.count);
+            if (status == 0) status = eval_predicate(step->op.pred, &sel, &out);
+            if (status == 0) {
+                free(sel.bits);
+                sel.bits = out.bits;
+                step->entries += selection_count(&sel);
+            } else {
+                selection_free(&out);
+            }
+            k++;
+            continue;
+        }
+        if (step->sketch) {
+            status = sketch_selection(ds, &sel, &step->op, step->sketch);
+            k++;
+            continue;
+        }
+
+        Operation run[MAX_FUSED_OPS];
+        for (int j=0; j<step->run_length; j++) {
+            run[j] = steps[k+j].op;
+        }
+        GroupTable chunk;
+        status = aggregate_totals(ds, &sel, NULL, run, step->run_length, &chunk);
+        if (status == 0 && !step->started) {
+            step->totals = chunk;
+            step->started = 1;
+        } else if (status == 0) {
+            status = group_table_merge(&step->totals, &chunk, NULL);
+            group_table_free(&chunk);
+        }
+        k += step->run_length;
+    }
+    for (int k=0; k<num_steps; k++) {
+        free_operation(&steps[k].op);
+    }
+    selection_free(&sel);
+    return status;
+}
+
+/* Top up the window from fp. Rows parsed so far keep string views into the
+ * window, so when it has to grow those views move over to the new block. */
+static int stream_fill(FILE *fp, Dataset *ds, char **pos, size_t *capacity, int *at_eof) {
+    char *buf = ds->buffer;
+    if (ds->buffer_len + 1 >= *capacity) {
+        size_t grown = *capacity*2;
+        char *p = malloc(grown);
+        if (!p) return -1;
+        memcpy(p, buf, ds->buffer_len);
+        for (int c=0; c<ds->num_columns; c++) {
+            Column *col = &ds->columns[c];
+            if (col->type != COL_STRING && col->type != COL_UNKNOWN) continue;
+            for (int r=0; r<ds->count; r++) {
+                col->s[r] = p + (col->s[r] - buf);
+            }
+        }
+        *pos = p + (*pos - buf);
+        free(buf);
+        ds->buffer = buf = p;
+        *capacity = grown;
+    }
+    size_t n = fread(buf + ds->buffer_len, 1, *capacity - ds->buffer_len - 1, fp);
+    ds->buffer_len += n;
+    if (n == 0) {
+        *at_eof = 1;
+        // A last line without a newline still counts
+        if (ds->buffer_len > (size_t)(*pos - buf) && buf[ds->buffer_len-1] != '\n') {
+            buf[ds->buffer_len++] = '\n';
+        }
+    }
+    return 0;
+}
+
+/* --stream: evaluate a filter and aggregate script while reading the CSV,
+ * holding one chunk of rows at a time. Results are printed at the end,
+ * line for line as a full load would print them. */
+static int stream_operations(const char *data_file, const char *ops_file, OutputFormat format) {
+    FILE *ops = fopen(ops_file, "r");
+    FILE *fp = fopen(data_file, "r");
+    StreamStep *steps = NULL;
+    int num_steps = 0, capacity_steps = 0;
+    char line[1024];
+    int line_num = 0;
+    while (ops && fgets(line, sizeof(line), ops)) {
+        line_num++;
+        const char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p) continue;
+        if (num_steps == capacity_steps) {
+            capacity_steps = capacity_steps ? capacity_steps*2 : 32;
+            StreamStep *grown = realloc(steps, sizeof(StreamStep)*capacity_steps);
+            if (!grown) break;
+            steps = grown;
+        }
+        memset(&steps[num_steps], 0, sizeof(StreamStep));
+        strcpy(steps[num_steps].line, line);
+        steps[num_steps].line_num = line_num;
+        num_steps++;
+    }
+    if (ops) fclose(ops);
+
+    Dataset ds;
+    memset(&ds, 0, sizeof(ds));
+    size_t capacity = 1 << 20;
+    ds.buffer = malloc(capacity);
+    int status = fp && ds.buffer ? 0 : -1;
+    int at_eof = 0;
+    char *pos = ds.buffer;
+    int *field_to_column = NULL;
+    char **fields = NULL;
+    int hcount = 0;
+    long long total_rows = 0;
+    int checked = 0;
+    line_num = 1;
+
+    // Header: read until its line is complete
+    while (status == 0 && !at_eof && !memchr(ds.buffer, '\n', ds.buffer_len)) {
+        status = stream_fill(fp, &ds, &pos, &capacity, &at_eof);
+    }
+    if (status == 0 && ds.buffer_len >= 8 && memcmp(ds.buffer, SNAPSHOT_MAGIC, 8) == 0) {
+        fprintf(stderr, "Error: --stream reads a CSV file, not a snapshot.\n");
+        status = -2;
+    }
+    if (status == 0 && ds.buffer_len > 0) {
+        char *headers[200];
+        hcount = tokenize_record(&pos, headers, 200);
+        if (hcount > 200) hcount = 200;
+        field_to_column = hcount > 0 ? build_schema(&ds, headers, hcount) : NULL;
+        fields = malloc(sizeof(char*)*(hcount > 0 ? hcount : 1));
+        for (size_t i=0; field_to_column && i<sizeof(required_columns)/sizeof(required_columns[0]); i++) {
+            int c = find_column(&ds, required_columns[i]);
+            if (c < 0) {
+                fprintf(stderr, "Error: Missing required column in demographics file.\n");
+                status = -2;
+                break;
+            }
+            ds.columns[c].required = 1;
+        }
+    }
+    if (status == 0 && (!field_to_column || !fields)) {
+        fprintf(stderr, ds.buffer_len ? "Error: Cannot parse demographics header.\n" : "Error: Demographics file is empty.\n");
+        status = -2;
+    }
+
+    while (status == 0) {
+        char *end = ds.buffer + ds.buffer_len;
+        char *last = pos < end ? memrchr(pos, '\n', (size_t)(end - pos)) : NULL;
+        while (last && pos <= last && ds.count < STREAM_CHUNK_ROWS) {
+            line_num++;
+            int count = tokenize_record(&pos, fields, hcount);
+            if (count < 0 || append_row(&ds, fields, count, field_to_column, hcount) != 0) {
+                fprintf(stderr, "Error: Malformed line %d in demographics file. Skipping.\n", line_num);
+            }
+        }
+        int chunk_done = ds.count == STREAM_CHUNK_ROWS || (at_eof && !(pos < end));
+        if (!chunk_done) {
+            status = stream_fill(fp, &ds, &pos, &capacity, &at_eof);
+            continue;
+        }
+
+        if (status == 0 && !checked) {
+            // The first rows settle the column types; now the script can be checked.
+            // A column blank throughout them has no type yet, so no line can use it.
+            for (int c=0; c<ds.num_columns; c++) {
+                if (ds.columns[c].type == COL_UNKNOWN) {
+                    fprintf(stderr, "Warning: Column '%s' is blank in the first %d records; --stream cannot use it.\n",
+                            ds.columns[c].name, STREAM_CHUNK_ROWS);
+                }
+            }
+            for (int k=0; k<num_steps && status == 0; k++) {
+                Operation op;
+                if (compile_operation(steps[k].line, steps[k].line_num, &ds, &op, stderr) != 0) {
+                    memmove(&steps[k], &steps[k+1], sizeof(StreamStep)*(num_steps-k-1));
+                    num_steps--;
+                    k--;
+                    continue;
+                }
+                if (!is_streamable(&op)) {
+                    fprintf(stderr, "Error: --stream only runs filter, aggregate, median, quantile and histogram operations (line %d).\n", steps[k].line_num);
+                    status = -2;
+                }
+                if (op.kind == OP_QUANTILE || op.kind == OP_HISTOGRAM) {
+                    steps[k].sketch = calloc(1, sizeof(QuantileSketch));
+                    if (!steps[k].sketch) status = -1;
+                    steps[k].spec = op;
+                    steps[k].spec.approximate = 1;
+                }
+                steps[k].kind = op.kind;
+                strcpy(steps[k].name, op.name);
+                if (op.label) steps[k].label = strdup(op.label);
+                free_operation(&op);
+            }
+            for (int k=0; k<num_steps; ) {
+                int n = 1;
+                if (steps[k].kind != OP_FILTER && !steps[k].sketch) {
+                    while (k+n < num_steps && steps[k+n].kind != OP_FILTER && !steps[k+n].sketch && n < MAX_FUSED_OPS) n++;
+                    steps[k].run_length = n;
+                }
+                k += n;
+            }
+            checked = 1;
+        }
+        if (status == 0 && (ds.count || total_rows == 0)) {
+            status = stream_chunk(&ds, steps, num_steps);
+        }
+        total_rows += ds.count;
+        ds.count = 0;
+
+        // The chunk's text is done with; keep only the unparsed tail
+        size_t tail = ds.buffer_len - (size_t)(pos - ds.buffer);
+        memmove(ds.buffer, pos, tail);
+        ds.buffer_len = tail;
+        pos = ds.buffer;
+        if (at_eof && !(pos < ds.buffer + ds.buffer_len)) break;
+    }
+
+    if (status == -1) {
+        fprintf(stderr, fp ? "Error: Out of memory.\n" : "Error: Cannot open demographics file '%s'\n", data_file);
+    } else if (status == 0) {
+        static Output out;
+        out.fp = stdout;
+        out.err = stderr;
+        out.format = format;
+        fprintf(LOAD_LOG, "%lld records loaded\n", total_rows);
+        for (int k=0; k<num_steps; ) {
+            if (steps[k].kind == OP_FILTER) {
+                output_filter_status(&out, steps[k].label, steps[k].entries);
+                k++;
+                continue;
+            }
+            if (steps[k].sketch) {
+                print_distribution(&out, &steps[k].spec, NULL, 0, steps[k].sketch);
+                k++;
+                continue;
+            }
+            Operation run[MAX_FUSED_OPS];
+            for (int j=0; j<steps[k].run_length; j++) {
+                memset(&run[j], 0, sizeof(Operation));
+                run[j].kind = steps[k+j].kind;
+                strcpy(run[j].name, steps[k+j].name);
+            }
+            print_aggregates(&out, run, steps[k].run_length, steps[k].totals.groups[0].total_pop, steps[k].totals.sums,
+                             steps[k].totals.missing);
+            k += steps[k].run_length;
+        }
+        output_flush(&out);
+    }
+
+    for (int k=0; k<num_steps; k++) {
+        free(steps[k].label);
+        free(steps[k].sketch);
+        group_table_free(&steps[k].totals);
+    }
+    free(steps);
+    free(fields);
+    free(field_to_column);
+    if (fp) fclose(fp);
+    free_dataset(&ds);
+    return status == 0 ? 0 : -1;
+}
+
+/* One ops script against a fresh selection over the shared dataset */
+static void serve_request(FILE *in, const Dataset *ds, Output *out) {
+    QueryState qs;
+    if (query_state_init(&qs, ds->count) < 0) {
+        output_error(out, "Error: Out of memory.\n");
+        return;
+    }
+    qs.out = out;
+    run_operations(in, ds, &qs);
+    query_state_free(&qs);
+}
+
+/* --serve: scripts arrive on stdin, each ended by a line holding just '.'
+ * (or by end of input). Results go to stdout, followed by a '.' line. */
+static void serve_stdin(const Dataset *ds, OutputFormat format) {
+    Output *out = calloc(1, sizeof(Output));
+    if (!out) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return;
+    }
+    out->fp = stdout;
+    out->err = stderr;
+    out->format = format;
+
+    char *script = NULL;
+    size_t script_len = 0;
+    FILE *batch = open_memstream(&script, &script_len);
+    char line[1024];
+    int pending = 0;
+    while (batch) {
+        int at_end = !fgets(line, sizeof(line), stdin);
+        if (!at_end && strcmp(line, ".\n") != 0 && strcmp(line, ".\r\n") != 0 && strcmp(line, ".") != 0) {
+            fputs(line, batch);
+            pending = 1;
+            continue;
+        }
+        if (at_end && !pending) break;
+
+        fclose(batch);
+        FILE *in = script_len ? fmemopen(script, script_len, "r") : NULL;
+        if (in) {
+            serve_request(in, ds, out);
+            fclose(in);
+        }
+        fputs(".\n", stdout);
+        fflush(stdout);
+        free(script);
+        script = NULL;
+        script_len = 0;
+        pending = 0;
+        batch = at_end ? NULL : open_memstream(&script, &script_len);
+    }
+    if (batch) fclose(batch);
+    free(script);
+    free(out);
+}
+
+/* A run of bytes one script wrote to stdout or to stderr */
+typedef struct {
+    int to_err;
+    size_t len;
+} ScriptSpan;
+
+/* One ops file of a multi-file run; its output is held until every file
+ * before it has been written. Both streams go into text in the order they
+ * were written, and spans says which bytes belong to which */
+typedef struct {
+    const char *filename;
+    char *text;
+    size_t len, capacity;
+    ScriptSpan *spans;
+    int num_spans, capacity_spans;
+    int failed;
+    int done;
+} ScriptJob;
+
+/* The cookie behind a script's stdout or stderr FILE */
+typedef struct {
+    ScriptJob *job;
+    int to_err;
+} ScriptStream;
+
+/* fopencookie write: append to the job's text, extending the last span when
+ * it is for the same stream */
+static ssize_t script_stream_write(void *cookie, const char *buf, size_t size) {
+    ScriptStream *stream = cookie;
+    ScriptJob *job = stream->job;
+    if (size == 0) return 0;
+    if (job->len + size > job->capacity) {
+        size_t capacity = job->capacity ? job->capacity : 4096;
+        while (capacity < job->len + size) capacity *= 2;
+        char *text = realloc(job->text, capacity);
+        if (!text) {
+            job->failed = 1;
+            return -1;
+        }
+        job->text = text;
+        job->capacity = capacity;
+    }
+    ScriptSpan *last = job->num_spans ? &job->spans[job->num_spans-1] : NULL;
+    if (!last || last->to_err != stream->to_err) {
+        if (job->num_spans == job->capacity_spans) {
+            int capacity = job->capacity_spans ? job->capacity_spans*2 : 8;
+            ScriptSpan *spans = realloc(job->spans, capacity*sizeof(ScriptSpan));
+            if (!spans) {
+                job->failed = 1;
+                return -1;
+            }
+            job->spans = spans;
+            job->capacity_spans = capacity;
+        }
+        last = &job->spans[job->num_spans++];
+        last->to_err = stream->to_err;
+        last->len = 0;
+    }
+    memcpy(job->text + job->len, buf, size);
+    job->len += size;
+    last->len += size;
+    return size;
+}
+
+/* A FILE that writes into job's ordered text; unbuffered, so each write
+ * lands in the order it was made */
+static FILE *script_stream_open(ScriptStream *stream, ScriptJob *job, int to_err) {
+    cookie_io_functions_t io = { NULL, script_stream_write, NULL, NULL };
+    stream->job = job;
+    stream->to_err = to_err;
+    FILE *fp = fopencookie(stream, "w", io);
+    if (fp) setvbuf(fp, NULL, _IONBF, 0);
+    return fp;
+}
+
+typedef struct {
+    const Dataset *ds;
+    OutputFormat format;
+    ScriptJob *jobs;
+    int num_jobs;
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} ScriptRun;
+
+static void *script_worker(void *arg) {
+    ScriptRun *run = arg;
+    Output *out = calloc(1, sizeof(Output));
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        int k = run->next < run->num_jobs ? run->next++ : -1;
+        pthread_mutex_unlock(&run->lock);
+        if (k < 0) break;
+
+        ScriptJob *job = &run->jobs[k];
+        ScriptStream out_stream, err_stream;
+        FILE *fp = out ? script_stream_open(&out_stream, job, 0) : NULL;
+        FILE *err = out ? script_stream_open(&err_stream, job, 1) : NULL;
+        FILE *in = fopen(job->filename, "r");
+        if (fp && err && in) {
+            out->fp = fp;
+            out->err = err;
+            out->format = run->format;
+            out->len = 0;
+            serve_request(in, run->ds, out);
+        } else if (fp && err) {
+            fprintf(err, "Error: Cannot open operations file '%s'\n", job->filename);
+        } else {
+            job->failed = 1;
+        }
+        if (in) fclose(in);
+        if (fp) fclose(fp);
+        if (err) fclose(err);
+
+        pthread_mutex_lock(&run->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&run->finished);
+        pthread_mutex_unlock(&run->lock);
+    }
+    free(out);
+    return NULL;
+}
+
+/* Several ops files: run them concurrently, each with its own selection and
+ * buffered output, and write the results out in argument order, with each
+ * script's errors where they fell among its results */
+static void run_scripts(char **files, int num_files, const Dataset *ds, OutputFormat format, int num_threads) {
+    ScriptRun run;
+    memset(&run, 0, sizeof(run));
+    run.ds = ds;
+    run.format = format;
+    run.num_jobs = num_files;
+    run.jobs = calloc(num_files, sizeof(ScriptJob));
+    if (!run.jobs) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return;
+    }
+    for (int k=0; k<num_files; k++) {
+        run.jobs[k].filename = files[k];
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.finished, NULL);
+
+    if (num_threads > num_files) num_threads = num_files;
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    while (started < num_threads && pthread_create(&threads[started], NULL, script_worker, &run) == 0) {
+        started++;
+    }
+    if (started == 0) script_worker(&run);
+
+    for (int k=0; k<num_files; k++) {
+        ScriptJob *job = &run.jobs[k];
+        pthread_mutex_lock(&run.lock);
+        while (!job->done) pthread_cond_wait(&run.finished, &run.lock);
+        pthread_mutex_unlock(&run.lock);
+        const char *text = job->text;
+        for (int s=0; s<job->num_spans; s++) {
+            const ScriptSpan *span = &job->spans[s];
+            fflush(span->to_err ? stdout : stderr);
+            fwrite(text, 1, span->len, span->to_err ? stderr : stdout);
+            text += span->len;
+        }
+        if (job->failed) fprintf(stderr, "Error: Out of memory.\n");
+        free(job->text);
+        free(job->spans);
+    }
+    for (int t=0; t<started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.finished);
+    free(run.jobs);
+}
 
+/* Accepted connections waiting for a worker */
+#define SERVE_QUEUE_SIZE 256
+
+/* A client that sends or takes nothing for this long is dropped, so a
+ * stalled connection cannot hold a worker forever */
+#define SERVE_TIMEOUT_SECONDS 30
+
+typedef struct {
+    const Dataset *ds;
+    OutputFormat format;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    int fds[SERVE_QUEUE_SIZE];
+    int head;
     int count;
-    CountyRecord *records = load_demographics(dem_file, &count);
-    if (!records) {
+} ServeQueue;
+
+/* Worker: a connection carries one script, read until the client shuts
+ * down its side; results and errors are written back on the socket */
+static void *serve_worker(void *arg) {
+    ServeQueue *q = arg;
+    Output *out = calloc(1, sizeof(Output));
+    if (!out) return NULL;
+    out->format = q->format;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0) pthread_cond_wait(&q->ready, &q->lock);
+        int fd = q->fds[q->head];
+        q->head = (q->head + 1) % SERVE_QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->space);
+        pthread_mutex_unlock(&q->lock);
+
+        int out_fd = dup(fd);
+        FILE *in = fdopen(fd, "r");
+        FILE *fp = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+        if (!in || !fp) {
+            if (in) fclose(in); else close(fd);
+            if (fp) fclose(fp); else if (out_fd >= 0) close(out_fd);
+            continue;
+        }
+        out->fp = fp;
+        out->err = fp;
+        out->len = 0;
+        serve_request(in, q->ds, out);
+        if (ferror(in)) {
+            output_error(out, "Error: Timed out reading the script.\n");
+            output_flush(out);
+        }
+        fclose(fp);
+        fclose(in);
+    }
+    return NULL;
+}
+
+/* --serve=<path>: answer scripts sent over a Unix domain socket, one per
+ * connection, on a pool of worker threads. Runs until killed. */
+static int serve_socket(const char *path, const Dataset *ds, OutputFormat format, int num_workers) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s'\n", path);
+        if (listen_fd >= 0) close(listen_fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);   // a client that hangs up early must not end the server
+
+    static ServeQueue q;
+    q.ds = ds;
+    q.format = format;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    pthread_cond_init(&q.space, NULL);
+    for (int t=0; t<num_workers; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, &q) != 0) {
+            fprintf(stderr, "Error: Cannot start worker thread\n");
+            close(listen_fd);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    printf("Serving on %s\n", path);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        struct timeval timeout = {SERVE_TIMEOUT_SECONDS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        pthread_mutex_lock(&q.lock);
+        while (q.count == SERVE_QUEUE_SIZE) pthread_cond_wait(&q.space, &q.lock);
+        q.fds[(q.head + q.count) % SERVE_QUEUE_SIZE] = fd;
+        q.count++;
+        pthread_cond_signal(&q.ready);
+        pthread_mutex_unlock(&q.lock);
+    }
+    return 0;
+}
+
+/* --bench: times of each run; the fastest is reported, with the median
+ * alongside to show the spread */
+#define BENCH_RUNS 5
+
+/* One script per op type, plus a grouped aggregate and a compound filter */
+static const struct {
+    const char *name;
+    const char *script;
+} bench_cases[] = {
+    {"filter", "filter:Education.High School or Higher:ge:80\n"},
+    {"filter-state", "filter-state:CA\n"},
+    {"where", "where:State in CA,NV,TX and not ([Education.High School or Higher] ge 80)\n"},
+    {"population-total", "population-total\n"},
+    {"population", "population:Education.Bachelor's Degree or Higher\n"},
+    {"percent", "percent:Income.Persons Below Poverty Level\n"},
+    {"group-by", "group-by:State\npercent:Income.Persons Below Poverty Level\n"},
+    {"median", "median:Income.Median Household Income\n"},
+    {"median-approx", "median:Income.Median Household Income:approx\n"},
+    {"histogram", "histogram:Income.Persons Below Poverty Level:20\n"},
+    {"top", "top:20:Income.Persons Below Poverty Level:desc\n"},
+    {"sort", "sort:Income.Median Household Income\n"},
+    {"display", "display\n"},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* One JSON line. Throughput counts every row of the dataset, so figures
+ * compare across op types; bytes are what one run reads: the CSV for the
+ * load, the column data its steps touch for an op or script. */
+static void bench_report(Output *o, const char *kind, const char *name, int rows, size_t bytes,
+                         double *times, int runs) {
+    qsort(times, runs, sizeof(double), compare_doubles);
+    double best = times[0] > 1e-9 ? times[0] : 1e-9;
+    output_str(o, "{\"kind\":");
+    output_json_string(o, kind);
+    output_str(o, ",\"name\":");
+    output_json_string(o, name);
+    output_printf(o, ",\"rows\":%d,\"bytes\":%zu,\"threads\":%d,\"runs\":%d", rows, bytes, thread_count(), runs);
+    output_printf(o, ",\"seconds\":%.6f,\"median_seconds\":%.6f", times[0], times[runs/2]);
+    output_printf(o, ",\"rows_per_sec\":%.0f,\"mb_per_sec\":%.1f}\n", rows/best, bytes/best/1e6);
+    output_flush(o);
+}
+
+/* Run one script over a fresh selection, its output thrown away; with a
+ * profile, its steps are recorded there */
+static double bench_script(FILE *script, const Dataset *ds, Output *sink, Profile *profile) {
+    QueryState qs;
+    if (query_state_init(&qs, ds->count) < 0) return -1.0;
+    qs.out = sink;
+    qs.profile = profile;
+    rewind(script);
+    double start = now_seconds();
+    run_operations(script, ds, &qs);
+    output_flush(sink);
+    double elapsed = now_seconds() - start;
+    query_state_free(&qs);
+    return elapsed;
+}
+
+/* --bench: the load (with --index, including the index build), each entry
+ * of bench_cases and then each operations file given */
+static int run_bench(const char *dem_file, char **ops_files, int num_ops_files, OutputFormat format, int index) {
+    static Output report, sink;
+    report.fp = stdout;
+    report.err = stderr;
+    sink.fp = fopen("/dev/null", "w");
+    sink.err = stderr;
+    sink.format = format;
+    if (!sink.fp) {
+        fprintf(stderr, "Error: Cannot open /dev/null\n");
+        return -1;
+    }
+
+    struct stat st;
+    size_t bytes = stat(dem_file, &st) == 0 ? (size_t)st.st_size : 0;
+    double times[BENCH_RUNS];
+    Dataset ds;
+    quiet_load = 1;
+    for (int run=0; run<BENCH_RUNS; run++) {
+        double start = now_seconds();
+        if (load_dataset(dem_file, &ds) < 0) {
+            fclose(sink.fp);
+            return -1;
+        }
+        if (index && build_indexes(&ds) < 0) {
+            free_dataset(&ds);
+            fclose(sink.fp);
+            return -1;
+        }
+        times[run] = now_seconds() - start;
+        if (run < BENCH_RUNS-1) free_dataset(&ds);
+    }
+    bench_report(&report, "load", dem_file, ds.count, bytes, times, BENCH_RUNS);
+
+    int status = 0;
+    int num_cases = (int)(sizeof(bench_cases)/sizeof(bench_cases[0]));
+    for (int k=0; k<num_cases + num_ops_files && status == 0; k++) {
+        const char *kind = k < num_cases ? "op" : "script";
+        const char *name = k < num_cases ? bench_cases[k].name : ops_files[k - num_cases];
+        FILE *script = k < num_cases ? fmemopen((void *)bench_cases[k].script, strlen(bench_cases[k].script), "r")
+                                     : fopen(name, "r");
+        if (!script) {
+            fprintf(stderr, "Error: Cannot open operations file '%s'\n", name);
+            status = -1;
+            break;
+        }
+        for (int run=0; run<BENCH_RUNS && status == 0; run++) {
+            times[run] = bench_script(script, &ds, &sink, NULL);
+            if (times[run] < 0) {
+                fprintf(stderr, "Error: Out of memory.\n");
+                status = -1;
+            }
+        }
+        // One more, untimed, run counts the bytes its steps read
+        Profile profile = {0};
+        size_t touched = 0;
+        if (status == 0 && bench_script(script, &ds, &sink, &profile) < 0) {
+            fprintf(stderr, "Error: Out of memory.\n");
+            status = -1;
+        }
+        for (int s=0; s<profile.count; s++) {
+            touched += (size_t)profile.steps[s].bytes_read;
+        }
+        free(profile.steps);
+        fclose(script);
+        if (status == 0) bench_report(&report, kind, name, ds.count, touched, times, BENCH_RUNS);
+    }
+    free_dataset(&ds);
+    fclose(sink.fp);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    const char *snapshot_file = NULL;
+    const char *serve_path = NULL;
+    int serve = 0;
+    int index = 0;
+    int stream = 0;
+    int bench = 0;
+    int profiling = 0;
+    static Profile profile;
+    const char *joins[MAX_JOIN_FILES];
+    int num_joins = 0;
+    int argi = 1;
+    OutputFormat format = FORMAT_TEXT;
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--snapshot") == 0 && argi+1 < argc) {
+            snapshot_file = argv[argi+1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "--join") == 0 && argi+1 < argc) {
+            if (num_joins == MAX_JOIN_FILES) {
+                fprintf(stderr, "Error: At most %d --join files\n", MAX_JOIN_FILES);
+                return 1;
+            }
+            joins[num_joins++] = argv[argi+1];
+            argi += 2;
+        } else if (strncmp(argv[argi], "--format=", 9) == 0) {
+            const char *name = argv[argi] + 9;
+            if (strcmp(name, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(name, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(name, "jsonl") == 0) {
+                format = FORMAT_JSONL;
+            } else {
+                fprintf(stderr, "Error: Unknown format '%s'\n", name);
+                return 1;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--stream") == 0) {
+            stream = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--profile") == 0 || strcmp(argv[argi], "--profile=json") == 0) {
+            profiling = 1;
+            profile.json = argv[argi][9] == '=';
+            argi++;
+        } else if (strcmp(argv[argi], "--bench") == 0) {
+            bench = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "--index") == 0) {
+            index = 1;
+            argi++;
+        } else if (strncmp(argv[argi], "--threads=", 10) == 0) {
+            if (convert_to_int(argv[argi] + 10, &thread_limit) < 0 || thread_limit < 1 || thread_limit > MAX_THREADS) {
+                fprintf(stderr, "Error: --threads takes a count from 1 to %d\n", MAX_THREADS);
+                return 1;
+            }
+            argi++;
+        } else if (strcmp(argv[argi], "--serve") == 0 || strncmp(argv[argi], "--serve=", 8) == 0) {
+            serve = 1;
+            serve_path = argv[argi][7] == '=' ? argv[argi] + 8 : NULL;
+            argi++;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[argi]);
+            return 1;
+        }
+    }
+
+    // With --snapshot or --bench the operations file is optional; --serve takes none
+    if (argc - argi < (snapshot_file || serve || bench ? 1 : 2) || (serve && argc - argi > 1)) {
+        fprintf(stderr, "Call with 2 arguments: [--format=text|csv|jsonl] <demographics_file> <operations_file>...\n");
+        fprintf(stderr, "   or: --snapshot <out.bin> <demographics_file> [operations_file]\n");
+        fprintf(stderr, "   or: --serve[=<socket>] <demographics_file>\n");
+        fprintf(stderr, "   or: --bench <demographics_file> [operations_file]...\n");
+        return 1;
+    }
+    if (bench && (serve || snapshot_file || stream || num_joins)) {
+        fprintf(stderr, "Error: --bench takes no --serve, --snapshot, --stream or --join\n");
+        return 1;
+    }
+    if (profiling && (serve || stream || bench || argc - argi > 2)) {
+        fprintf(stderr, "Error: --profile takes at most one operations file, and no --serve, --stream or --bench\n");
+        return 1;
+    }
+    if (stream && (serve || snapshot_file || index || num_joins || argc - argi != 2)) {
+        fprintf(stderr, "Error: --stream takes one CSV and one operations file, and no --serve, --snapshot, --index or --join\n");
+        return 1;
+    }
+
+    const char *dem_file = argv[argi];
+    const char *ops_file = argi+1 < argc ? argv[argi+1] : NULL;
+    int num_ops_files = argc - argi - 1;
+
+    FILE *fp = fopen(dem_file, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open demographics file '%s'\n", dem_file);
+        return 1;
+    }
+    fclose(fp);
+
+    for (int k=0; k<num_ops_files; k++) {
+        fp = fopen(argv[argi+1+k], "r");
+        if (!fp) {
+            fprintf(stderr, "Error: Cannot open operations file '%s'\n", argv[argi+1+k]);
+            return 1;
+        }
+        fclose(fp);
+    }
+
+    load_to_stderr = format == FORMAT_JSONL;
+    if (bench) {
+        return run_bench(dem_file, argv + argi + 1, num_ops_files, format, index) < 0 ? 1 : 0;
+    }
+    if (stream) {
+        return stream_operations(dem_file, ops_file, format) < 0 ? 1 : 0;
+    }
+
+    Dataset ds;
+    ProfileStep *step = profiling ? profile_begin(&profile, "load", 0, 0, NULL) : NULL;
+    if (load_dataset(dem_file, &ds) < 0) {
+        return 1;
+    }
+    profile_end(step, ds.count, ds.buffer_len, NULL);
+
+    if ((snapshot_file || num_joins) && ds.borrowed_columns) {
+        fprintf(stderr, "Error: '%s' is already a snapshot.\n", dem_file);
+        free_dataset(&ds);
+        return 1;
+    }
+    for (int j=0; j<num_joins; j++) {
+        step = profiling ? profile_begin(&profile, "join", 0, ds.count, NULL) : NULL;
+        if (join_dataset(&ds, joins[j]) < 0) {
+            free_dataset(&ds);
+            return 1;
+        }
+        profile_end(step, ds.count, 0, NULL);
+    }
+    step = profiling && index ? profile_begin(&profile, "index", 0, ds.count, NULL) : NULL;
+    if (index && build_indexes(&ds) < 0) {
+        free_dataset(&ds);
+        return 1;
+    }
+    profile_end(step, ds.count, 0, NULL);
+    step = profiling && snapshot_file ? profile_begin(&profile, "snapshot", 0, ds.count, NULL) : NULL;
+    if (snapshot_file && write_snapshot(&ds, dem_file, joins, num_joins, snapshot_file) < 0) {
+        free_dataset(&ds);
+        return 1;
+    }
+    profile_end(step, ds.count, 0, NULL);
+    if (serve && serve_path) {
+        // Clients mostly wait on I/O, so keep a few workers even on one CPU
+        int workers = thread_count();
+        if (!thread_limit && workers < 4) workers = 4;
+        int status = serve_socket(serve_path, &ds, format, workers);
+        free_dataset(&ds);
+        return status < 0 ? 1 : 0;
+    }
+    if (serve) {
+        serve_stdin(&ds, format);
+        free_dataset(&ds);
+        return 0;
+    }
+    if (!ops_file) {
+        if (profiling) print_profile(&profile);
+        free(profile.steps);
+        free_dataset(&ds);
+        return 0;
+    }
+    if (num_ops_files > 1) {
+        run_scripts(argv + argi + 1, num_ops_files, &ds, format, thread_count());
+        free_dataset(&ds);
+        return 0;
+    }
+
+    QueryState qs;
+    if (query_state_init(&qs, ds.count) < 0) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free_dataset(&ds);
         return 1;
     }
 
-    process_operations(ops_file, records, count);
+    static Output out;
+    out.fp = stdout;
+    out.err = stderr;
+    out.format = format;
+    qs.out = &out;
+    qs.profile = profiling ? &profile : NULL;
+    process_operations(ops_file, &ds, &qs);
+    if (profiling) print_profile(&profile);
+    free(profile.steps);
 
-    free_records(records, count);
+    query_state_free(&qs);
+    free_dataset(&ds);
     return 0;
 }